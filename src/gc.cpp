@@ -1,8 +1,170 @@
 #include "gc.h"
 #include <optional>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 namespace gc {
 bool enable_time_tracking = false;
+namespace detail {
+#ifndef _WIN32
+static void *map_aligned(size_t size, size_t alignment, int protection, int flags) {
+    static const size_t os_page_size = sysconf(_SC_PAGESIZE);
+    // over-allocate and trim both ends to get an aligned range
+    auto extra = alignment > os_page_size ? alignment : 0;
+    auto raw = mmap(nullptr, size + extra, protection, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (raw == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    auto begin = reinterpret_cast<uintptr_t>(raw);
+    auto aligned = extra ? (begin + alignment - 1) & ~(alignment - 1) : begin;
+    if (aligned > begin) {
+        munmap(raw, aligned - begin);
+    }
+    if (auto tail = begin + size + extra - (aligned + size); tail > 0) {
+        munmap(reinterpret_cast<void *>(aligned + size), tail);
+    }
+    return reinterpret_cast<void *>(aligned);
+}
+#endif
+void *os_map(size_t size, size_t alignment) {
+#ifdef _WIN32
+    // allocations are aligned to the 64KiB allocation granularity
+    GC_ASSERT(alignment <= 64 * 1024, "Alignment too large");
+    auto ptr = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+#else
+    return map_aligned(size, alignment, PROT_READ | PROT_WRITE, 0);
+#endif
+}
+void *os_reserve(size_t size, size_t alignment) {
+#ifdef _WIN32
+    GC_ASSERT(alignment <= 64 * 1024, "Alignment too large");
+    auto ptr = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+#else
+    // nothing is charged against overcommit, and nothing is backed until it is touched. debug builds keep the
+    // uncommitted parts inaccessible, at the cost of a mapping per committed range
+    return map_aligned(size, alignment, is_debug ? PROT_NONE : PROT_READ | PROT_WRITE, MAP_NORESERVE);
+#endif
+}
+void os_unmap(void *ptr, size_t size) {
+#ifdef _WIN32
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+void os_commit(void *ptr, size_t size) {
+#ifdef _WIN32
+    GC_ASSERT(VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE), "Failed to commit memory");
+#else
+    // the pages come back zeroed on first touch
+    if constexpr (is_debug) {
+        GC_ASSERT(mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0, "Failed to commit memory");
+    }
+#endif
+}
+void os_decommit(void *ptr, size_t size) {
+#ifdef _WIN32
+    VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+    // unlike MADV_FREE, the pages leave the resident set right away instead of whenever the kernel needs them.
+    // protecting them as well would split the reservation into a mapping per region, and a large fragmented heap
+    // would run into vm.max_map_count. only debug builds do, so that a stray access faults instead of reading zeros
+    GC_ASSERT(madvise(ptr, size, MADV_DONTNEED) == 0, "Failed to decommit memory");
+    if constexpr (is_debug) {
+        GC_ASSERT(mprotect(ptr, size, PROT_NONE) == 0, "Failed to decommit memory");
+    }
+#endif
+}
+/// maps `path` copy-on-write, writes to the mapping never reach the file. null if it can't be opened or is empty
+static void *os_map_file(const std::string &path, size_t &size) {
+#ifdef _WIN32
+    auto file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return nullptr;
+    }
+    auto mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        return nullptr;
+    }
+    // the view keeps the mapping alive
+    auto ptr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    size = static_cast<size_t>(file_size.QuadPart);
+    return ptr;
+#else
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = static_cast<size_t>(st.st_size);
+    auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+}
+/// false if the pages could not be made read-only
+static bool os_protect_readonly(void *ptr, size_t size) {
+#ifdef _WIN32
+    DWORD old_protection;
+    return VirtualProtect(ptr, size, PAGE_READONLY, &old_protection) != 0;
+#else
+    return mprotect(ptr, size, PROT_READ) == 0;
+#endif
+}
+static void os_unmap_file(void *ptr, size_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap(ptr, size);
+#endif
+}
+size_t os_resident_bytes() {
+#ifdef __linux__
+    auto file = std::fopen("/proc/self/statm", "r");
+    if (!file) {
+        return 0;
+    }
+    size_t total = 0, resident = 0;
+    auto n = std::fscanf(file, "%zu %zu", &total, &resident);
+    std::fclose(file);
+    return n == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+}// namespace detail
 void TracingContext::shade(const GcObjectContainer *ptr) const noexcept {
+    if (mortal_refs && ptr && !ptr->is_immortal()) {
+        ++*mortal_refs;
+    }
     // heap.work_list.with([&](auto &wl, auto *lock) {
     heap.shade(ptr, pool_idx);
     // });
@@ -13,37 +175,762 @@ void GcHeap::shade(const GcObjectContainer *ptr, size_t pool_idx) {
             return;
         }
     }
-    if (!ptr || ptr->color() != color::WHITE)
+    if (!ptr)
+        return;
+    if (ptr->in_leaf_space()) {
+        LeafSpace::mark(ptr);
+        return;
+    }
+    if (ptr->color() != color::WHITE)
         return;
     detail::check_alive(ptr);
+    // nothing to trace, so skip the gray state and the work list altogether
+    auto shaded = ptr->is_pointer_free() ? color::BLACK : color::GRAY;
     if (is_paralle_collection()) {
         uint8_t expected = color::WHITE;
-        if (!ptr->color_.compare_exchange_strong(expected, color::GRAY)) {
+        if (!ptr->color_.compare_exchange_strong(expected, shaded)) {
             return;
         }
     } else {
-        ptr->set_color(color::GRAY);
+        ptr->set_color(shaded);
     }
-    if (ptr->as_tracable()) {
+    if (shaded == color::GRAY && ptr->as_tracable()) {
         add_to_working_list(ptr, pool_idx);
     }
 }
+LeafSpace::~LeafSpace() {
+    // the memory goes away with the region space
+    for (auto &pages : pages_) {
+        for (auto page : pages) {
+            page->~Page();
+        }
+    }
+}
+LeafSpace::Page *LeafSpace::new_page() {
+    void *memory = nullptr;
+    if (!free_pages_.empty()) {
+        // the most recently emptied page is the most likely to still be in the cache
+        memory = free_pages_.back().page;
+        free_pages_.pop_back();
+    } else {
+        memory = regions_->allocate_regions(1, RegionSpace::Kind::LEAF);
+    }
+    return new (memory) Page{};
+}
+const GcObjectContainer *LeafSpace::object_at(const void *ptr) {
+    auto page = page_of(ptr);
+    auto offset = static_cast<const std::byte *>(ptr) - reinterpret_cast<const std::byte *>(page);
+    if (offset < static_cast<ptrdiff_t>(Page::slots_offset)) {
+        return nullptr;
+    }
+    auto idx = (offset - Page::slots_offset) / page->slot_size;
+    if (idx >= page->n_slots || !(page->alloc_bits[idx / 64] & (1ull << (idx % 64)))) {
+        return nullptr;
+    }
+    return reinterpret_cast<const GcObjectContainer *>(page->slot(idx));
+}
+size_t LeafSpace::decommit_free_pages(size_t delay) {
+    // oldest first
+    size_t n = 0;
+    while (n < free_pages_.size() && n_sweeps_ - free_pages_[n].freed_at >= delay) {
+        regions_->free_regions(free_pages_[n].page, 1);
+        n++;
+    }
+    free_pages_.erase(free_pages_.begin(), free_pages_.begin() + n);
+    return n * page_size;
+}
+bool LeafSpace::is_movable(Page *page) {
+    for (size_t w = 0; w * 64 < page->n_slots; w++) {
+        auto bits = page->alloc_bits[w];
+        if (page->pinned_bits[w].load(std::memory_order_acquire) & bits) {
+            return false;
+        }
+        for (; bits; bits &= bits - 1) {
+            auto obj = reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(bits)));
+            if (!obj->is_relocatable() || obj->is_root() || obj->is_pinned()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+size_t LeafSpace::evacuate(double threshold) {
+    size_t n_moved = 0;
+    for (size_t c = 0; c < size_classes.size(); c++) {
+        auto &pages = pages_[c];
+        std::vector<Page *> sources;
+        for (auto page : pages) {
+            if (page->n_used < page->n_slots * threshold && is_movable(page)) {
+                sources.push_back(page);
+            }
+        }
+        if (sources.empty()) {
+            continue;
+        }
+        // the sparsest pages go first, as long as what they hold fits into the free slots of the pages that stay
+        std::ranges::sort(sources, {}, &Page::n_used);
+        size_t n_free = 0;
+        for (auto page : pages) {
+            n_free += page->n_slots - page->n_used;
+        }
+        size_t n_sources = 0;
+        size_t n_moving = 0;
+        for (auto page : sources) {
+            n_free -= page->n_slots - page->n_used;
+            if (n_moving + page->n_used > n_free) {
+                break;
+            }
+            n_moving += page->n_used;
+            n_sources++;
+        }
+        sources.resize(n_sources);
+        std::erase_if(pages, [&](Page *page) {
+            return std::ranges::find(sources, page) != sources.end();
+        });
+        auto &cursor = cursors_[c];
+        cursor = 0;
+        for (auto page : sources) {
+            for (size_t w = 0; w * 64 < page->n_slots; w++) {
+                for (auto bits = page->alloc_bits[w]; bits; bits &= bits - 1) {
+                    auto idx = w * 64 + std::countr_zero(bits);
+                    auto obj = reinterpret_cast<GcObjectContainer *>(page->slot(idx));
+                    void *copy = nullptr;
+                    while (!copy) {
+                        GC_ASSERT(cursor < pages.size(), "Evacuated objects should fit into the remaining pages");
+                        if (pages[cursor]->n_used < pages[cursor]->n_slots) {
+                            copy = allocate_from(pages[cursor], page->destructor_bits[w] & (1ull << (idx % 64)));
+                        }
+                        if (!copy) {
+                            cursor++;
+                        }
+                    }
+                    std::memcpy(copy, obj, page->slot_size);
+                    unpin(reinterpret_cast<GcObjectContainer *>(copy));
+                    obj->flags_.fetch_or(object_flags::FORWARDED, std::memory_order_relaxed);
+                    obj->next_ = reinterpret_cast<GcObjectContainer *>(copy);
+                    n_moved++;
+                }
+            }
+            evacuated_.push_back(page);
+        }
+    }
+    return n_moved;
+}
+size_t LeafSpace::finish_evacuation() {
+    for (auto page : evacuated_) {
+        page->~Page();
+        free_pages_.push_back(FreePage{page, n_sweeps_});
+    }
+    return std::exchange(evacuated_, {}).size();
+}
+double LeafSpace::occupancy() const {
+    size_t used = 0;
+    size_t capacity = 0;
+    for (auto &pages : pages_) {
+        for (auto page : pages) {
+            used += size_t(page->n_used) * page->slot_size;
+            capacity += size_t(page->n_slots) * page->slot_size;
+        }
+    }
+    return capacity ? double(used) / capacity : 1.0;
+}
+void *LeafSpace::allocate_from(Page *page, bool needs_destructor) {
+    for (size_t w = page->cursor; w * 64 < page->n_slots; w++) {
+        auto free = ~page->alloc_bits[w] & page->valid_mask(w);
+        if (free == 0) {
+            continue;
+        }
+        auto bit = std::countr_zero(free);
+        page->alloc_bits[w] |= 1ull << bit;
+        page->pinned_bits[w].fetch_or(1ull << bit, std::memory_order_relaxed);
+        if (needs_destructor) {
+            page->destructor_bits[w] |= 1ull << bit;
+        }
+        page->n_used++;
+        page->cursor = static_cast<uint32_t>(w);
+        return page->slot(w * 64 + bit);
+    }
+    page->cursor = bitmap_words;
+    return nullptr;
+}
+void *LeafSpace::allocate(size_t size_class, bool needs_destructor) {
+    auto &pages = pages_[size_class];
+    auto &cursor = cursors_[size_class];
+    for (; cursor < pages.size(); cursor++) {
+        auto page = pages[cursor];
+        if (page->n_used < page->n_slots) {
+            if (auto ptr = allocate_from(page, needs_destructor)) {
+                return ptr;
+            }
+        }
+    }
+    auto page = new_page();
+    page->slot_size = size_classes[size_class];
+    page->n_slots = static_cast<uint32_t>((page_size - Page::slots_offset) / page->slot_size);
+    pages.push_back(page);
+    cursor = pages.size() - 1;
+    return allocate_from(page, needs_destructor);
+}
+std::pair<size_t, size_t> LeafSpace::sweep(std::vector<GcObjectContainer *> *deferred) {
+    size_t freed = 0;
+    size_t freed_bytes = 0;
+    for (size_t c = 0; c < size_classes.size(); c++) {
+        auto &pages = pages_[c];
+        std::erase_if(pages, [&](Page *page) {
+            size_t page_freed = 0;
+            for (size_t w = 0; w < bitmap_words && w * 64 < page->n_slots; w++) {
+                auto live = page->mark_bits[w].exchange(0, std::memory_order_relaxed) | page->pinned_bits[w].load(std::memory_order_acquire);
+                auto dead = page->alloc_bits[w] & ~live;
+                if (dead == 0) {
+                    continue;
+                }
+                if constexpr (is_debug) {
+                    for (auto bits = dead; bits; bits &= bits - 1) {
+                        reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(bits)))->set_alive(false);
+                    }
+                }
+                for (auto finalize = dead & page->destructor_bits[w]; finalize; finalize &= finalize - 1) {
+                    auto obj = reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(finalize)));
+                    if (deferred) {
+                        deferred->push_back(obj);
+                    } else {
+                        obj->~GcObjectContainer();
+                    }
+                }
+                if (deferred) {
+                    // the slot stays allocated, the pin keeps the next sweep from seeing it as dead again
+                    auto finalize = dead & page->destructor_bits[w];
+                    page->pinned_bits[w].fetch_or(finalize, std::memory_order_relaxed);
+                    live |= finalize;
+                    dead &= ~finalize;
+                }
+                page->alloc_bits[w] &= live;
+                page->destructor_bits[w] &= live;
+                page_freed += std::popcount(dead);
+            }
+            page->n_used -= static_cast<uint32_t>(page_freed);
+            page->cursor = 0;
+            freed += page_freed;
+            freed_bytes += page_freed * page->slot_size;
+            if (page->n_used == 0) {
+                page->~Page();
+                free_pages_.push_back(FreePage{page, n_sweeps_});
+                return true;
+            }
+            return false;
+        });
+        cursors_[c] = 0;
+    }
+    n_sweeps_++;
+    return {freed, freed_bytes};
+}
+size_t LeafSpace::release(std::span<GcObjectContainer *const> slots) {
+    size_t freed_bytes = 0;
+    for (auto obj : slots) {
+        auto page = page_of(obj);
+        auto idx = page->index_of(obj);
+        auto w = idx / 64;
+        auto bit = 1ull << (idx % 64);
+        GC_ASSERT(page->alloc_bits[w] & bit, "Releasing a free slot");
+        page->alloc_bits[w] &= ~bit;
+        page->destructor_bits[w] &= ~bit;
+        page->pinned_bits[w].fetch_and(~bit, std::memory_order_relaxed);
+        page->n_used--;
+        page->cursor = std::min(page->cursor, static_cast<uint32_t>(w));
+        freed_bytes += page->slot_size;
+    }
+    // pages that became empty are given back by the next sweep
+    cursors_.fill(0);
+    return freed_bytes;
+}
+void LeafSpace::clear_marks() {
+    for (auto &pages : pages_) {
+        for (auto page : pages) {
+            for (auto &bits : page->mark_bits) {
+                bits.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+size_t LeafSpace::finalize_all() {
+    size_t n = 0;
+    for (auto &pages : pages_) {
+        for (auto page : pages) {
+            for (size_t w = 0; w < bitmap_words && w * 64 < page->n_slots; w++) {
+                for (auto finalize = page->alloc_bits[w] & page->destructor_bits[w]; finalize; finalize &= finalize - 1) {
+                    reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(finalize)))->~GcObjectContainer();
+                }
+                page->alloc_bits[w] = 0;
+                page->destructor_bits[w] = 0;
+            }
+            n += page->n_used;
+            page->n_used = 0;
+        }
+    }
+    return n;
+}
+size_t LeafSpace::object_count() const {
+    size_t n = 0;
+    for (auto &pages : pages_) {
+        for (auto page : pages) {
+            n += page->n_used;
+        }
+    }
+    return n;
+}
+static_assert([] {
+    for (size_t size = 1; size <= PoolSpace::max_size; size++) {
+        auto c = PoolSpace::size_class_of(size);
+        if (size > PoolSpace::size_classes[c] || (c > 0 && size <= PoolSpace::size_classes[c - 1])) {
+            return false;
+        }
+    }
+    return true;
+}(), "size_class_of should pick the smallest class that fits");
+PoolSpace::~PoolSpace() {
+    // the memory goes away with the region space
+    for (auto *classes : {&objects_, &buffers_}) {
+        for (auto &size_class : *classes) {
+            for (auto page : size_class.pages) {
+                page->~Page();
+            }
+        }
+    }
+}
+PoolSpace::Page *PoolSpace::new_page() {
+    void *memory = nullptr;
+    if (!free_pages_.empty()) {
+        // the most recently emptied page is the most likely to still be in the cache
+        memory = free_pages_.back().page;
+        free_pages_.pop_back();
+    } else {
+        memory = regions_->allocate_regions(1, RegionSpace::Kind::CHUNK);
+    }
+    return new (memory) Page{};
+}
+void *PoolSpace::allocate_from(Page *page, bool pin) {
+    for (size_t w = page->cursor; w * 64 < page->n_slots; w++) {
+        auto free = ~page->alloc_bits[w] & page->valid_mask(w);
+        if (free == 0) {
+            continue;
+        }
+        auto bit = std::countr_zero(free);
+        page->alloc_bits[w] |= 1ull << bit;
+        if (pin) {
+            page->pinned_bits[w].fetch_or(1ull << bit, std::memory_order_relaxed);
+        }
+        page->n_used++;
+        page->cursor = static_cast<uint32_t>(w);
+        return page->slot(w * 64 + bit);
+    }
+    page->cursor = bitmap_words;
+    return nullptr;
+}
+void *PoolSpace::allocate_in(std::array<SizeClass, size_classes.size()> &classes, size_t bytes, size_t alignment, bool pin) {
+    if (passes_through(bytes, alignment)) {
+        GC_ASSERT(alignment <= RegionSpace::region_size, "Alignment too large");
+        return regions_->allocate_regions(RegionSpace::regions_for(bytes), RegionSpace::Kind::CHUNK);
+    }
+    auto c = size_class_of(bytes);
+    auto &size_class = classes[c];
+    auto &available = size_class.available;
+    while (!available.empty()) {
+        auto page = available.back();
+        if (auto ptr = allocate_from(page, pin)) {
+            return ptr;
+        }
+        page->available = false;
+        available.pop_back();
+    }
+    auto page = new_page();
+    page->owner = &size_class;
+    page->slot_size = size_classes[c];
+    page->n_slots = static_cast<uint32_t>((page_size - Page::slots_offset) / page->slot_size);
+    page->available = true;
+    size_class.pages.push_back(page);
+    available.push_back(page);
+    return allocate_from(page, pin);
+}
+void PoolSpace::do_deallocate(void *p, size_t bytes, size_t alignment) {
+    if (passes_through(bytes, alignment)) {
+        regions_->free_regions(p, RegionSpace::regions_for(bytes));
+        return;
+    }
+    if (!reuse_) {
+        return;
+    }
+    auto page = page_of(p);
+    auto idx = page->index_of(p);
+    auto w = idx / 64;
+    auto bit = 1ull << (idx % 64);
+    GC_ASSERT(page->alloc_bits[w] & bit, "Freeing a free slot");
+    page->alloc_bits[w] &= ~bit;
+    page->pinned_bits[w].fetch_and(~bit, std::memory_order_relaxed);
+    page->n_used--;
+    page->cursor = std::min(page->cursor, static_cast<uint32_t>(w));
+    if (!page->available) {
+        page->available = true;
+        page->owner->available.push_back(page);
+    }
+}
+size_t PoolSpace::decommit_free_pages(size_t delay) {
+    for (auto *classes : {&objects_, &buffers_}) {
+        for (auto &size_class : *classes) {
+            std::erase_if(size_class.available, [](Page *page) {
+                return page->n_used == 0;
+            });
+            std::erase_if(size_class.pages, [&](Page *page) {
+                if (page->n_used != 0) {
+                    return false;
+                }
+                page->~Page();
+                free_pages_.push_back(FreePage{page, n_sweeps_});
+                return true;
+            });
+        }
+    }
+    n_sweeps_++;
+    // oldest first
+    size_t n = 0;
+    while (n < free_pages_.size() && n_sweeps_ - free_pages_[n].freed_at >= delay) {
+        regions_->free_regions(free_pages_[n].page, 1);
+        n++;
+    }
+    free_pages_.erase(free_pages_.begin(), free_pages_.begin() + n);
+    return n * page_size;
+}
+bool PoolSpace::is_movable(Page *page) {
+    for (size_t w = 0; w * 64 < page->n_slots; w++) {
+        auto bits = page->alloc_bits[w];
+        if (page->pinned_bits[w].load(std::memory_order_acquire) & bits) {
+            return false;
+        }
+        for (; bits; bits &= bits - 1) {
+            auto obj = reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(bits)));
+            // dead objects waiting for the finalizer thread and promoted ones are referenced from outside the graph
+            if (!obj->is_relocatable() || obj->is_root() || obj->is_pinned() || obj->is_immortal() || !obj->is_alive()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+size_t PoolSpace::evacuate(double threshold) {
+    size_t n_moved = 0;
+    for (size_t c = 0; c < size_classes.size(); c++) {
+        auto &size_class = objects_[c];
+        auto &pages = size_class.pages;
+        std::vector<Page *> sources;
+        for (auto page : pages) {
+            // empty pages are left to `decommit_free_pages`
+            if (page->n_used > 0 && page->n_used < page->n_slots * threshold && is_movable(page)) {
+                sources.push_back(page);
+            }
+        }
+        if (sources.empty()) {
+            continue;
+        }
+        // the sparsest pages go first, as long as what they hold fits into the free slots of the pages that stay
+        std::ranges::sort(sources, {}, &Page::n_used);
+        size_t n_free = 0;
+        for (auto page : pages) {
+            n_free += page->n_slots - page->n_used;
+        }
+        size_t n_sources = 0;
+        size_t n_moving = 0;
+        for (auto page : sources) {
+            n_free -= page->n_slots - page->n_used;
+            if (n_moving + page->n_used > n_free) {
+                break;
+            }
+            n_moving += page->n_used;
+            n_sources++;
+        }
+        sources.resize(n_sources);
+        auto is_source = [&](Page *page) {
+            return std::ranges::find(sources, page) != sources.end();
+        };
+        std::erase_if(pages, is_source);
+        std::erase_if(size_class.available, is_source);
+        for (auto page : sources) {
+            for (size_t w = 0; w * 64 < page->n_slots; w++) {
+                for (auto bits = page->alloc_bits[w]; bits; bits &= bits - 1) {
+                    auto obj = reinterpret_cast<GcObjectContainer *>(page->slot(w * 64 + std::countr_zero(bits)));
+                    // every page with a free slot is available, and they have room for all of it
+                    auto copy = static_cast<GcObjectContainer *>(allocate_in(objects_, page->slot_size, 1, true));
+                    std::memcpy(static_cast<void *>(copy), obj, page->slot_size);
+                    unpin(copy);
+                    regions_->clear_start(obj);
+                    regions_->mark_start(copy);
+                    // the copy keeps the link to the next object of its list
+                    obj->flags_.fetch_or(object_flags::FORWARDED, std::memory_order_relaxed);
+                    obj->next_ = copy;
+                    n_moved++;
+                }
+            }
+            evacuated_.push_back(page);
+        }
+    }
+    return n_moved;
+}
+size_t PoolSpace::finish_evacuation() {
+    for (auto page : evacuated_) {
+        page->~Page();
+        free_pages_.push_back(FreePage{page, n_sweeps_});
+    }
+    return std::exchange(evacuated_, {}).size();
+}
+RegionSpace::RegionSpace(size_t capacity)
+    : capacity_(regions_for(capacity) * region_size),
+      regions_(std::make_unique<std::atomic<Region>[]>(capacity_ / region_size)),
+      starts_size_(capacity_ / granule / 8) {
+    static_assert(region_size % (granule * 64) == 0, "a region should cover whole bitmap words");
+    GC_ASSERT(capacity_ > 0 && capacity_ / region_size <= std::numeric_limits<uint32_t>::max(), "Bad reserved address space");
+    base_ = static_cast<std::byte *>(detail::os_reserve(capacity_, region_size));
+    // zero-filled and only backed where it is written
+    starts_ = static_cast<uint64_t *>(detail::os_map(starts_size_, 0));
+    free_.emplace(0, capacity_ / region_size);
+}
+RegionSpace::~RegionSpace() {
+    detail::os_unmap(starts_, starts_size_);
+    detail::os_unmap(base_, capacity_);
+}
+std::byte *RegionSpace::allocate_regions(size_t n, Kind kind) {
+    size_t first = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // first fit keeps the heap packed towards the start of the range
+        auto it = std::find_if(free_.begin(), free_.end(), [&](auto &span) { return span.second >= n; });
+        if (it == free_.end()) {
+            throw std::bad_alloc();
+        }
+        auto [start, count] = *it;
+        free_.erase(it);
+        if (count > n) {
+            free_.emplace(start + n, count - n);
+        }
+        first = start;
+    }
+    auto ptr = base_ + first * region_size;
+    detail::os_commit(ptr, n * region_size);
+    for (size_t i = 0; i < n; i++) {
+        regions_[first + i].store(Region{kind, static_cast<uint32_t>(first)}, std::memory_order_release);
+    }
+    committed_.fetch_add(n * region_size, std::memory_order_relaxed);
+    if (kind == Kind::CHUNK) {
+        chunk_committed_.fetch_add(n * region_size, std::memory_order_relaxed);
+    }
+    return ptr;
+}
+void RegionSpace::free_regions(void *ptr, size_t n) {
+    auto first = index_of(ptr);
+    if (regions_[first].load(std::memory_order_relaxed).kind == Kind::CHUNK) {
+        // whatever the pools left behind, the next page here starts clean
+        constexpr size_t words_per_region = region_size / granule / 64;
+        std::memset(starts_ + first * words_per_region, 0, n * words_per_region * sizeof(uint64_t));
+        chunk_committed_.fetch_sub(n * region_size, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < n; i++) {
+        regions_[first + i].store(Region{}, std::memory_order_release);
+    }
+    detail::os_decommit(ptr, n * region_size);
+    committed_.fetch_sub(n * region_size, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto next = free_.lower_bound(first);
+    if (next != free_.end() && next->first == first + n) {
+        n += next->second;
+        next = free_.erase(next);
+    }
+    if (next != free_.begin()) {
+        if (auto prev = std::prev(next); prev->first + prev->second == first) {
+            prev->second += n;
+            return;
+        }
+    }
+    free_.emplace_hint(next, first, n);
+}
+const GcObjectContainer *RegionSpace::object_containing(const void *ptr) const {
+    if (!contains(ptr)) {
+        return nullptr;
+    }
+    auto region = region_of(ptr);
+    const GcObjectContainer *obj = nullptr;
+    switch (region.kind) {
+    case Kind::FREE:
+        return nullptr;
+    case Kind::LEAF:
+        obj = LeafSpace::object_at(ptr);
+        break;
+    case Kind::LARGE:
+        obj = reinterpret_cast<const GcObjectContainer *>(base_ + region.first * region_size);
+        break;
+    case Kind::CHUNK: {
+        // an object containing `ptr` starts at most `max_pooled_size` bytes before it, and within the page
+        auto g = granule_of(ptr);
+        auto lowest = std::max<size_t>(region.first * (region_size / granule), g > max_pooled_size / granule ? g - max_pooled_size / granule : 0);
+        for (auto w = g / 64;; w--) {
+            auto bits = std::atomic_ref(starts_[w]).load(std::memory_order_acquire);
+            if (w == g / 64 && g % 64 != 63) {
+                bits &= (2ull << (g % 64)) - 1;
+            }
+            if (bits) {
+                auto start = w * 64 + 63 - std::countl_zero(bits);
+                if (start >= lowest) {
+                    obj = reinterpret_cast<const GcObjectContainer *>(base_ + start * granule);
+                }
+                break;
+            }
+            if (w * 64 <= lowest) {
+                break;
+            }
+        }
+        break;
+    }
+    }
+    if (!obj || static_cast<const std::byte *>(ptr) >= reinterpret_cast<const std::byte *>(obj) + obj->allocation_size()) {
+        return nullptr;
+    }
+    return obj;
+}
+void *ImmortalSpace::Region::do_allocate(size_t bytes, size_t alignment) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto base = space->base_.load(std::memory_order_relaxed);
+    if (!base) {
+        base = static_cast<std::byte *>(detail::os_map(space->capacity_, card_size));
+        space->cards_ = std::make_unique<std::atomic<uint8_t>[]>(space->capacity_ / card_size + 1);
+        // published last, `contains` has to see the cards once it sees the range
+        space->base_.store(base, std::memory_order_release);
+    }
+    auto offset = (space->used_.load(std::memory_order_relaxed) + alignment - 1) & ~(alignment - 1);
+    if (offset + bytes > space->capacity_) {
+        throw std::bad_alloc();
+    }
+    space->used_.store(offset + bytes, std::memory_order_relaxed);
+    return base + offset;
+}
+ImmortalSpace::~ImmortalSpace() {
+    pool_.release();
+    if (auto base = base_.load(std::memory_order_relaxed)) {
+        detail::os_unmap(base, capacity_);
+    }
+}
+void ImmortalSpace::add_member(const void *slot, const GcObjectContainer *owner) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &owners = owners_[card_of(slot)];
+    // the members of one object are constructed one after another
+    if (owners.empty() || owners.back() != owner) {
+        owners.push_back(owner);
+    }
+}
+void ImmortalSpace::add_object(GcObjectContainer *obj) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    contents_.objects.push_back(obj);
+}
+void ImmortalSpace::add_promoted(GcObjectContainer *obj) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    contents_.promoted.push_back(obj);
+}
+void ImmortalSpace::add_unlinked(GcObjectContainer *obj) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    contents_.unlinked.push_back(obj);
+}
+std::vector<std::pair<size_t, std::vector<const GcObjectContainer *>>> ImmortalSpace::dirty_cards(bool clean) {
+    std::vector<std::pair<size_t, std::vector<const GcObjectContainer *>>> cards;
+    if (!base_.load(std::memory_order_acquire)) {
+        return cards;
+    }
+    auto n_cards = (used_.load(std::memory_order_relaxed) + card_size - 1) / card_size;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t card = 0; card < n_cards; card++) {
+        auto dirty = clean ? cards_[card].exchange(0, std::memory_order_acq_rel) : cards_[card].load(std::memory_order_acquire);
+        if (!dirty) {
+            continue;
+        }
+        if (auto it = owners_.find(card); it != owners_.end()) {
+            cards.emplace_back(card, it->second);
+        }
+    }
+    return cards;
+}
+std::vector<GcObjectContainer *> ImmortalSpace::promoted_objects() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return contents_.promoted;
+}
+ImmortalSpace::Contents ImmortalSpace::release() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    owners_.clear();
+    if (base_.load(std::memory_order_relaxed)) {
+        for (size_t card = 0; card <= capacity_ / card_size; card++) {
+            cards_[card].store(0, std::memory_order_relaxed);
+        }
+    }
+    return std::exchange(contents_, {});
+}
+namespace detail {
+constinit thread_local GcHeap *current_heap = nullptr;
+GcHeap *default_heap = nullptr;
+}// namespace detail
 static std::shared_ptr<GcHeap> heap;
+// every heap between its constructor and `stop`, for `GcHeap::owner_of`
+static std::mutex live_heaps_mutex;
+static std::vector<GcHeap *> live_heaps;
 thread_local std::optional<size_t> tl_pool_idx;
+void GcHeap::unregister() {
+    std::lock_guard<std::mutex> lock(live_heaps_mutex);
+    std::erase(live_heaps, this);
+}
+GcHeap *GcHeap::owner_of(const void *ptr) {
+    std::lock_guard<std::mutex> lock(live_heaps_mutex);
+    for (auto heap : live_heaps) {
+        if (heap->owns(ptr)) {
+            return heap;
+        }
+    }
+    return nullptr;
+}
 GcHeap::GcHeap(GcOption option, gc_ctor_token_t)
     : mode_(option.mode),
       max_heap_size_(option.max_heap_size),
       gc_threshold_(option.gc_threshold),
-      pool_(detail::emplace_t{}, option.mode == GcMode::CONCURRENT, option),
+      heap_limit_(option.initial_heap_size ? option.initial_heap_size : option.max_heap_size),
+      min_heap_size_(option.min_heap_size ? option.min_heap_size : heap_limit_.load()),
+      heap_target_live_ratio_(option.heap_target_live_ratio),
+      gc_cpu_budget_(option.gc_cpu_budget),
+      heap_shrink_ratio_(option.heap_shrink_ratio),
+      heap_growth_factor_(option.heap_growth_factor),
+      adaptive_heap_(min_heap_size_ < option.max_heap_size),
+      background_finalization_(option.background_finalization),
+      decommit_delay_(option.decommit_delay),
+      compaction_(option.compaction),
+      compaction_threshold_(option.compaction_threshold),
+      fast_teardown_(option.fast_teardown && !option.teardown_leak_check),
+      soft_ref_threshold_(option.soft_ref_threshold),
+      regions_(option.reserved_address_space ? option.reserved_address_space : std::max<size_t>(4 * option.max_heap_size, 1ull << 30)),
+      pool_(detail::emplace_t{}, option.mode == GcMode::CONCURRENT, option, &regions_),
       object_lists_(ObjectLists{}, option.mode == GcMode::CONCURRENT),
       root_set_(RootSet{}, option.mode == GcMode::CONCURRENT),
-      work_list(WorkList{}, option.mode == GcMode::CONCURRENT) {
+      work_list(WorkList{}, option.mode == GcMode::CONCURRENT),
+      leaf_space_(detail::emplace_t{}, option.mode == GcMode::CONCURRENT || option.background_finalization, &regions_),
+      immortal_space_(option.immortal_space_size),
+      images_(std::vector<MappedImage>{}, true),
+      finalization_queue_(std::vector<GcObjectContainer *>{}, option.background_finalization),
+      // weak handles are also dropped by destructors, which run on other threads with parallel sweeping or background finalization
+      weak_refs_(WeakRefs{}, option.mode == GcMode::CONCURRENT || option.background_finalization || option.n_collector_threads.has_value()),
+      cgroup_path_(option.cgroup_path),
+      memory_pressure_threshold_(option.memory_pressure_threshold),
+      pressure_poll_ms_(option.pressure_poll_ms),
+      retired_buffers_(std::vector<RetiredBuffer>{}, option.mode == GcMode::CONCURRENT) {
+    GC_ASSERT(min_heap_size_ <= heap_limit_ && heap_limit_ <= max_heap_size_, "Heap sizes should satisfy min <= initial <= max");
+    GC_ASSERT(heap_shrink_ratio_ < heap_target_live_ratio_, "Heap would shrink right after growing");
+    GC_ASSERT(!compaction_ || option.mode == GcMode::STOP_THE_WORLD, "Compaction needs stop-the-world mode");
     if (option.n_collector_threads.has_value()) {
         GC_ASSERT(option.mode != GcMode::INCREMENTAL, "Incremental mode does not support multiple threads");
         GC_ASSERT(option.n_collector_threads.value() > 0, "Number of collector threads should be positive");
+        GC_ASSERT(option.n_collector_threads.value() < immortal_pool_idx, "Too many collector threads");
         worker_pool_.emplace(option.n_collector_threads.value());
         worker_pool_->dispatch([&](size_t tid) {
             tl_pool_idx = tid;
+            detail::current_heap = this;
         });
         auto &concurrent_resources = pool_.get().concurrent_resources;
         auto &lists = object_lists_.get().lists;
@@ -58,6 +945,27 @@ GcHeap::GcHeap(GcOption option, gc_ctor_token_t)
         work_list.get().lists.emplace_back(std::move(std::make_unique<WorkList::list_t>(std::vector<const GcObjectContainer *>{}, false)));
         gc_memory_resource_.emplace_back(this, 0);
     }
+    std::lock_guard<std::mutex> lock(live_heaps_mutex);
+    live_heaps.push_back(this);
+}
+void GcHeap::retire_buffer(std::pmr::memory_resource *resource, void *ptr, size_t bytes, size_t alignment) {
+    if (mode_ != GcMode::CONCURRENT) {
+        // marking only happens inside the mutator's own allocation calls, nothing else can be reading the buffer
+        resource->deallocate(ptr, bytes, alignment);
+        return;
+    }
+    retired_buffers_.with([&](auto &buffers, auto *lock) {
+        buffers.push_back(RetiredBuffer{resource, ptr, bytes, alignment});
+    });
+}
+void GcHeap::free_retired_buffers() {
+    std::vector<RetiredBuffer> buffers;
+    retired_buffers_.with([&](auto &retired, auto *lock) {
+        std::swap(buffers, retired);
+    });
+    for (auto &buffer : buffers) {
+        buffer.resource->deallocate(buffer.ptr, buffer.bytes, buffer.alignment);
+    }
 }
 void GcHeap::signal_collection() {
     if constexpr (is_debug) {
@@ -76,7 +984,9 @@ void GcHeap::prepare_allocation_concurrent(size_t inc_size) {
                 auto since_last_collection = now - stats_.last_collect_time;
                 return since_last_collection > std::chrono::seconds(1);
             };
-            return pool.allocation_size_ + inc_size > max_heap_size_ * gc_threshold_ && (stats_.n_allocated - stats_.n_collected) >= stats_.last_collected;
+            // a cycle that may free external memory is worth it even when few objects were allocated since the last one
+            auto enough_allocated = (stats_.n_allocated - stats_.n_collected) >= stats_.last_collected || external_growth() > 0;
+            return (trigger_size() + inc_size > heap_limit_ * gc_threshold_ && enough_allocated) || take_memory_pressure();
         };
         stats_.wait_for_atomic_marking += time_function([&] {
             // while (pool.concurrent_state == ConcurrentState::ATOMIC_MARKING) {
@@ -144,10 +1054,93 @@ void GcHeap::prepare_allocation_concurrent(size_t inc_size) {
                 }
             }
         }
-        GC_ASSERT(is_mem_available(), "Out of memory");
+        if (is_mem_available()) {
+            return;
+        }
+        // running out of memory, escalate step by step before giving up
+        if (background_finalization_) {
+            finish_finalization();
+        }
+        // a cycle of our own from start to end. the pool stays locked, so the other mutators can't allocate meanwhile
+        auto full_cycle = [&] {
+            stats_.wait_for_atomic_marking += time_function([&] {
+                lock->wait([this, &pool] { return pool.concurrent_state != ConcurrentState::IDLE; });
+                signal_collection();
+                lock->wait([this, &pool] { return pool.concurrent_state != ConcurrentState::IDLE; });
+            });
+            if (background_finalization_) {
+                finish_finalization();
+            }
+        };
+        if (!is_mem_available()) {
+            full_cycle();
+        }
+        if (!is_mem_available()) {
+            clear_soft_refs_ = true;
+            full_cycle();
+        }
+        if (!is_mem_available() && call_low_memory_handler(inc_size, lock)) {
+            full_cycle();
+        }
+        if (!is_mem_available()) {
+            // the caller expects the pool to stay locked only when the allocation goes ahead
+            lock->unlock();
+            throw std::bad_alloc();
+        }
     },
                false, true);
 }
+void GcHeap::set_low_memory_handler(std::function<void(size_t)> handler) {
+    pool_.with([&](Pool &pool, auto *lock) {
+        low_memory_handler_ = std::move(handler);
+    });
+}
+bool GcHeap::call_low_memory_handler(size_t inc_size, detail::recursive_spinlock *pool_lock) {
+    if (!low_memory_handler_ || in_low_memory_handler_.exchange(true)) {
+        // nobody to ask, or the handler itself ran out of memory
+        return false;
+    }
+    // user code, which may well take locks of its own or drop references
+    if (pool_lock) {
+        pool_lock->unlock();
+    }
+    try {
+        low_memory_handler_(inc_size);
+    } catch (...) {
+        // leaves the allocation with the pool unlocked, just like running out of memory does
+        in_low_memory_handler_ = false;
+        throw;
+    }
+    in_low_memory_handler_ = false;
+    if (pool_lock) {
+        pool_lock->lock();
+    }
+    return true;
+}
+void GcHeap::recover_memory(size_t inc_size) {
+    auto is_mem_available = [&] { return pool_.get().allocation_size_ + inc_size <= max_heap_size_; };
+    if (background_finalization_) {
+        finish_finalization();
+    }
+    // an incremental cycle that had to be finished early keeps what was allocated during it, a fresh one does not.
+    // stop-the-world mode has just run a full collection
+    if (!is_mem_available() && mode_ == GcMode::INCREMENTAL) {
+        collect();
+    }
+    if (!is_mem_available()) {
+        clear_soft_refs_ = true;
+        collect();
+    }
+    if (!is_mem_available() && call_low_memory_handler(inc_size, nullptr)) {
+        collect();
+    }
+    if (background_finalization_) {
+        finish_finalization();
+    }
+    if (!is_mem_available()) {
+        throw std::bad_alloc();
+    }
+}
 void GcHeap::concurrent_collector() {
     while (!stop_collector_.load(std::memory_order_relaxed)) {
         pool_.with([&](Pool &pool, auto *lock) {
@@ -205,33 +1198,132 @@ void GcHeap::concurrent_collector() {
                 }
             });
             stats_.last_collected = stats_.n_collected.load();
-        });
+        },
+                               adaptive_heap_);
         stats_.collection_time.update(t);
+        update_heap_limit(t);
         stats_.n_collection_cycles.fetch_add(1, std::memory_order_relaxed);
     }
 }
+// a number from a cgroup interface file, nothing for "max" or when the file is not there
+static std::optional<size_t> read_cgroup_value(const std::string &path) {
+    auto file = std::fopen(path.c_str(), "r");
+    if (!file) {
+        return std::nullopt;
+    }
+    char buf[32] = {};
+    auto n = std::fscanf(file, "%31s", buf);
+    std::fclose(file);
+    if (n != 1 || std::strcmp(buf, "max") == 0) {
+        return std::nullopt;
+    }
+    return std::strtoull(buf, nullptr, 10);
+}
+// microseconds some task has stalled on memory in total, from the first line of memory.pressure
+static std::optional<size_t> read_pressure_stall(const std::string &path) {
+    auto file = std::fopen(path.c_str(), "r");
+    if (!file) {
+        return std::nullopt;
+    }
+    unsigned long long total = 0;
+    auto n = std::fscanf(file, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &total);
+    std::fclose(file);
+    if (n != 1) {
+        return std::nullopt;
+    }
+    return total;
+}
+static void apply_container_limits(GcOption &option) {
+    auto limit = read_cgroup_value(option.cgroup_path + "/memory.max");
+    if (!limit) {
+        return;
+    }
+    // what the rest of the process and the cgroup already use is not ours to take
+    auto current = read_cgroup_value(option.cgroup_path + "/memory.current").value_or(0);
+    auto room = *limit > current ? *limit - current : 0;
+    auto max_heap_size = std::min(option.max_heap_size, static_cast<size_t>(room * option.container_heap_fraction));
+    // memory.current counts page cache the kernel can reclaim, a cgroup that looks full is not out of memory.
+    // the heap keeps at least its minimum, or its own limit without one, and the pressure monitor takes it from there
+    if (max_heap_size < option.min_heap_size) {
+        max_heap_size = option.min_heap_size;
+    } else if (max_heap_size == 0) {
+        max_heap_size = option.max_heap_size;
+    }
+    if constexpr (verbose_output) {
+        std::printf("cgroup memory.max = %lld, memory.current = %lld, max_heap_size = %lld\n", *limit, current, max_heap_size);
+    }
+    option.max_heap_size = max_heap_size;
+    option.initial_heap_size = std::min(option.initial_heap_size, max_heap_size);
+    option.min_heap_size = std::min(option.min_heap_size, max_heap_size);
+}
+void GcHeap::pressure_monitor(size_t initial_stall) {
+    auto path = cgroup_path_ + "/memory.pressure";
+    std::optional<size_t> last_stall = initial_stall;
+    auto last_time = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(monitor_mutex_);
+    while (!monitor_wakeup_.wait_for(lock, std::chrono::milliseconds(pressure_poll_ms_), [this] { return stop_monitor_; })) {
+        auto stall = read_pressure_stall(path);
+        auto now = std::chrono::steady_clock::now();
+        if (stall && last_stall && *stall > *last_stall) {
+            auto stalled = (*stall - *last_stall) * 1e-6;
+            auto elapsed = std::chrono::duration<double>(now - last_time).count();
+            if (stalled > elapsed * memory_pressure_threshold_) {
+                memory_pressure_ = true;
+                stats_.n_pressure_events.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        last_stall = stall;
+        last_time = now;
+    }
+}
+std::shared_ptr<GcHeap> GcHeap::create(GcOption option) {
+    if (option.container_aware) {
+        apply_container_limits(option);
+    }
+    auto instance = std::make_shared<GcHeap>(option, gc_ctor_token_t{});
+    instance->start_threads(option);
+    return instance;
+}
+void GcHeap::start_threads(const GcOption &option) {
+    // each thread works on this heap only
+    if (option.mode == GcMode::CONCURRENT) {
+        collector_thread_.emplace([this] {
+            detail::current_heap = this;
+            concurrent_collector();
+        });
+    }
+    if (option.background_finalization) {
+        finalizer_thread_.emplace([this] {
+            detail::current_heap = this;
+            background_finalizer();
+        });
+    }
+    if (!option.container_aware) {
+        return;
+    }
+    // read before returning, so that any stall from here on counts
+    if (auto stall = read_pressure_stall(option.cgroup_path + "/memory.pressure")) {
+        pressure_monitor_.emplace([this, stall] {
+            detail::current_heap = this;
+            pressure_monitor(*stall);
+        });
+    }
+}
 void GcHeap::init(GcOption option) {
     if (heap) {
         std::fprintf(stderr, "Heap is already initialized\n");
         return std::abort();
     }
-    heap = std::make_shared<GcHeap>(option, gc_ctor_token_t{});
-    if (option.mode == GcMode::CONCURRENT) {
-        heap->collector_thread_.emplace([&] {
-            heap->concurrent_collector();
-        });
-    }
+    heap = create(std::move(option));
+    detail::default_heap = heap.get();
 }
 void GcHeap::destroy() {
     if (heap) {
         heap->stop();
+        detail::default_heap = nullptr;
         heap.reset();
     }
 }
-GcHeap &get_heap() {
-    GC_ASSERT(heap != nullptr, "Heap is not initialized");
-    return *heap;
-}
 void GcHeap::parallel_marking() {
     GC_ASSERT(worker_pool_.has_value(), "Worker pool should be initialized");
     auto &workers = worker_pool_.value();
@@ -303,6 +1395,9 @@ void GcHeap::scan_roots() {
         state() = State::MARKING;
     }
     auto t0 = std::chrono::high_resolution_clock::now();
+    if (mode_ != GcMode::CONCURRENT) {
+        take_cycle_baseline();
+    }
     root_set_.with([&](RootSet &rs, auto *lock) {
         if constexpr (is_debug) {
             std::printf("scanning %lld roots\n", rs.size());
@@ -324,6 +1419,8 @@ void GcHeap::scan_roots() {
             });
         }
     });
+    scan_immortal_space();
+    scan_soft_refs();
     auto t1 = std::chrono::high_resolution_clock::now();
     if constexpr (verbose_output) {
         auto t = (t1 - t0).count();
@@ -358,6 +1455,9 @@ std::tuple<size_t, size_t, GcObjectContainer *, GcObjectContainer *> GcHeap::swe
     auto collect_cnt = 0ull;
     auto object_ist_cnt = object_list.count.load();
     auto collected_bytes = 0ull;
+    std::vector<DeadObject> batch;
+    batch.reserve(free_batch_size);
+    std::vector<GcObjectContainer *> deferred;
     while (ptr) {
         auto next = ptr->next_;
         // if (mode() != GcMode::CONCURRENT) {
@@ -367,13 +1467,40 @@ std::tuple<size_t, size_t, GcObjectContainer *, GcObjectContainer *> GcHeap::swe
         if (ptr->is_root()) {
             GC_ASSERT(ptr->color() == color::BLACK, "Root should be black");
         }
-        if (ptr->color() == color::BLACK) {
+        if (ptr->is_immortal()) [[unlikely]] {
+            // promoted since the last sweep, it leaves the list for good and is never shaded again
+            ptr->set_color(color::BLACK);
+            immortal_space_.add_unlinked(ptr);
+            object_ist_cnt -= 1;
+            if (!prev) {
+                head = next;
+            } else {
+                prev->next_ = next;
+            }
+            ptr = next;
+        } else if (ptr->color() == color::BLACK) {
             prev = ptr;
             ptr->set_color(color::WHITE);
             ptr = next;
+        } else if (background_finalization_ && !ptr->has_trivial_destructor()) {
+            // unlinked now, destroyed and freed by the finalizer thread
+            ptr->set_alive(false);
+            deferred.push_back(ptr);
+            object_ist_cnt -= 1;
+            if (!prev) {
+                head = next;
+            } else {
+                prev->next_ = next;
+            }
+            ptr = next;
+            collect_cnt++;
         } else {
-            collected_bytes += ptr->object_size();
-            free_object(ptr, pool_idx);
+            auto dead = finalize_object(ptr, pool_idx);
+            collected_bytes += dead.size;
+            batch.push_back(dead);
+            if (batch.size() == free_batch_size) {
+                free_objects(batch, pool_idx);
+            }
 
             // object_list.count.fetch_sub(1, std::memory_order_relaxed);
             object_ist_cnt -= 1;
@@ -388,17 +1515,123 @@ std::tuple<size_t, size_t, GcObjectContainer *, GcObjectContainer *> GcHeap::swe
         }
         cnt++;
     }
+    free_objects(batch, pool_idx);
+    enqueue_finalizers(deferred);
     // stats_.n_collected.fetch_add(collect_cnt, std::memory_order_relaxed);
-    pool_.get().allocation_size_.fetch_sub(collected_bytes, std::memory_order_seq_cst);
+    pool_.get().release(collected_bytes);
     object_list.count.store(object_ist_cnt, std::memory_order_relaxed);
     if constexpr (verbose_output) { std::printf("sweeped %d objects, %d collected from pool %lld\n", cnt, collect_cnt, pool_idx); }
     return {collect_cnt, cnt, head, prev};
 }
+void GcHeap::finish_marking() {
+    if (is_paralle_collection()) {
+        parallel_marking();
+    } else {
+        while (mark_some(0xff)) {}
+    }
+}
+void GcHeap::process_weak_references() {
+    weak_refs_.with([&](WeakRefs &refs, auto *lock) {
+        // splits [0, n) among the collector threads when there are any
+        auto for_each_stripe = [&](size_t n, auto &&f) {
+            if (is_paralle_collection()) {
+                auto n_threads = worker_pool_->threads.size();
+                worker_pool_->dispatch([&](size_t tid) {
+                    for (size_t i = tid; i < n; i += n_threads) {
+                        f(i, tid);
+                    }
+                });
+            } else {
+                for (size_t i = 0; i < n; i++) {
+                    f(i, 0);
+                }
+            }
+        };
+        auto &tables = refs.tables;
+        for (;;) {
+            // in concurrent mode a `Weak` might have been upgraded right before we took the lock
+            finish_marking();
+            std::atomic_bool shaded = false;
+            for_each_stripe(tables.size(), [&](size_t i, size_t tid) {
+                auto table = tables[i];
+                if (!is_marked(table->owner)) {
+                    return;
+                }
+                for (size_t j = 0; j < table->capacity; j++) {
+                    auto &entry = table->entries[j];
+                    if (entry.state == EphemeronTable::FULL && entry.value && is_marked(entry.key) && !is_marked(entry.value)) {
+                        shade(entry.value, tid);
+                        shaded.store(true, std::memory_order_relaxed);
+                    }
+                }
+            });
+            if (!shaded) {
+                break;
+            }
+        }
+        for_each_stripe(tables.size(), [&](size_t i, size_t tid) {
+            auto table = tables[i];
+            if (!is_marked(table->owner)) {
+                // about to be swept along with its entries
+                return;
+            }
+            for (size_t j = 0; j < table->capacity; j++) {
+                auto &entry = table->entries[j];
+                if (entry.state == EphemeronTable::FULL && !is_marked(entry.key)) {
+                    table->remove(entry);
+                }
+            }
+        });
+        constexpr size_t slots_per_stripe = 4096;
+        auto &slots = refs.slots;
+        std::atomic<size_t> n_soft_cleared = 0;
+        for_each_stripe((slots.size() + slots_per_stripe - 1) / slots_per_stripe, [&](size_t i, size_t tid) {
+            auto end = std::min(slots.size(), (i + 1) * slots_per_stripe);
+            size_t n_cleared = 0;
+            for (auto j = i * slots_per_stripe; j < end; j++) {
+                if (slots[j].target && !is_marked(slots[j].target)) {
+                    slots[j].target = nullptr;
+                    n_cleared += slots[j].soft;
+                }
+            }
+            n_soft_cleared.fetch_add(n_cleared, std::memory_order_relaxed);
+        });
+        stats_.n_soft_refs_cleared.fetch_add(n_soft_cleared, std::memory_order_relaxed);
+    });
+}
+void GcHeap::scan_soft_refs() {
+    auto clear_all = clear_soft_refs_.exchange(false);
+    weak_refs_.with([&](WeakRefs &refs, auto *lock) {
+        if (refs.n_soft == 0) {
+            return;
+        }
+        std::vector<WeakRefs::Slot *> soft;
+        for (auto &slot : refs.slots) {
+            if (slot.soft && slot.target) {
+                soft.push_back(&slot);
+            }
+        }
+        // how far the live heap is past the threshold decides how many go, all of them once it is full
+        auto occupancy = static_cast<double>(live_after_sweep_.load()) / max_heap_size_;
+        auto pressure = std::clamp((occupancy - soft_ref_threshold_) / (1.0 - soft_ref_threshold_), 0.0, 1.0);
+        auto n_clear = clear_all ? soft.size() : static_cast<size_t>(std::ceil(pressure * soft.size()));
+        // least recently used first, those are left for the sweep to clear unless something else reaches them
+        std::ranges::nth_element(soft, soft.begin() + n_clear, {}, &WeakRefs::Slot::last_used);
+        work_list.with([&](WorkList &wl, auto *lock) {
+            for (auto it = soft.begin() + n_clear; it != soft.end(); ++it) {
+                shade((*it)->target, wl.least_filled());
+            }
+        });
+    });
+}
 void GcHeap::sweep() {
+    process_weak_references();
     if (mode_ != GcMode::CONCURRENT) {
         state() = State::SWEEPING;
     }
     auto t = time_function([&] {
+        // marking is over, no one is tracing through the retired buffers anymore
+        free_retired_buffers();
         // GcObjectContainer *head = nullptr;
         // GcObjectContainer *ptr = nullptr;
         // GcObjectContainer *prev = nullptr;
@@ -469,6 +1702,38 @@ void GcHeap::sweep() {
             }
         }
 
+        for (auto &resource : pool_.get().concurrent_resources) {
+            resource->with([&](auto &space, auto *lock) {
+                stats_.decommitted_bytes.fetch_add(space->decommit_free_pages(decommit_delay_), std::memory_order_relaxed);
+            });
+        }
+        std::vector<GcObjectContainer *> deferred;
+        leaf_space_.with([&](LeafSpace &space, auto *lock) {
+            auto [n_freed, freed_bytes] = space.sweep(background_finalization_ ? &deferred : nullptr);
+            stats_.n_collected.fetch_add(n_freed + deferred.size(), std::memory_order_relaxed);
+            pool_.get().release(freed_bytes);
+            stats_.decommitted_bytes.fetch_add(space.decommit_free_pages(decommit_delay_), std::memory_order_relaxed);
+            stats_.committed_bytes = regions_.committed_bytes();
+            stats_.pool_committed_bytes = regions_.chunk_committed_bytes();
+        });
+        stats_.resident_bytes = detail::os_resident_bytes();
+        enqueue_finalizers(deferred);
+        if (compaction_) {
+            compact();
+        }
+        stats_.leaf_occupancy = leaf_space_.with([&](LeafSpace &space, auto *lock) {
+            return space.occupancy();
+        });
+
+        live_after_sweep_ = pool_.get().allocation_size_.load();
+        external_after_sweep_ = external_size_.load();
+        // unlike what is left after the sweep, this leaves out everything allocated while the cycle ran
+        auto freed = pool_.get().freed_size_.load() - freed_at_cycle_start_;
+        live_set_ = allocation_at_cycle_start_ - std::min(freed, allocation_at_cycle_start_);
+        if (mode_ == GcMode::CONCURRENT) {
+            // concurrent mutators shade what they allocate even between cycles, so the next cycle keeps all of it
+            take_cycle_baseline();
+        }
         if (mode_ != GcMode::CONCURRENT) {
             state() = State::IDLE;
         }
@@ -476,6 +1741,479 @@ void GcHeap::sweep() {
     stats_.sweep_time.update(t);
     stats_.last_collect_time = std::chrono::high_resolution_clock::now();
 }
+void GcHeap::compact() {
+    auto n_moved = leaf_space_.with([&](LeafSpace &space, auto *lock) {
+        return space.evacuate(compaction_threshold_);
+    });
+    for (auto &resource : pool_.get().concurrent_resources) {
+        n_moved += resource->with([&](auto &space, auto *lock) {
+            return space->evacuate(compaction_threshold_);
+        });
+    }
+    if (n_moved == 0) {
+        return;
+    }
+    // everything that can point at a moved object is either a member of an object in the lists or a weak reference.
+    // a moved object kept its link in the copy, so a list only has to be pointed at the copies
+    TracingContext ctx{*this, 0};
+    ctx.relocating = true;
+    object_lists_.with([&](auto &lists, auto *lock) {
+        for (auto &list : lists.lists) {
+            list->with([&](ObjectList &list, auto *lock) {
+                for (auto link = &list.head; *link; link = &(*link)->next_) {
+                    if (auto moved = (*link)->forwarding_address()) {
+                        *link = const_cast<GcObjectContainer *>(moved);
+                    }
+                }
+                for (auto ptr = list.head; ptr; ptr = ptr->next_) {
+                    if (ptr->is_pointer_free()) {
+                        continue;
+                    }
+                    if (auto traceable = ptr->as_tracable()) {
+                        traceable->trace(Tracer{ctx});
+                    }
+                }
+            });
+        }
+    });
+    // immortal objects can only point at a moved one from a dirty card, or when they were promoted in place
+    for (auto &[card, owners] : immortal_space_.dirty_cards(false)) {
+        for (auto owner : owners) {
+            if (owner->is_immortal()) {
+                owner->as_tracable()->trace(Tracer{ctx});
+            }
+        }
+    }
+    for (auto ptr : immortal_space_.promoted_objects()) {
+        if (!ptr->is_pointer_free()) {
+            ptr->as_tracable()->trace(Tracer{ctx});
+        }
+    }
+    auto forward = [](const GcObjectContainer *&ptr) {
+        if (ptr) {
+            if (auto moved = ptr->forwarding_address()) {
+                ptr = moved;
+            }
+        }
+    };
+    weak_refs_.with([&](WeakRefs &refs, auto *lock) {
+        for (auto &slot : refs.slots) {
+            forward(slot.target);
+        }
+        for (auto table : refs.tables) {
+            for (size_t i = 0; i < table->capacity; i++) {
+                if (table->entries[i].state == EphemeronTable::FULL) {
+                    forward(table->entries[i].key);
+                    forward(table->entries[i].value);
+                }
+            }
+        }
+    });
+    auto n_pages = leaf_space_.with([&](LeafSpace &space, auto *lock) {
+        return space.finish_evacuation();
+    });
+    for (auto &resource : pool_.get().concurrent_resources) {
+        n_pages += resource->with([&](auto &space, auto *lock) {
+            return space->finish_evacuation();
+        });
+    }
+    stats_.n_objects_moved += n_moved;
+    stats_.n_pages_evacuated += n_pages;
+}
+void GcHeap::scan_immortal_space() {
+    // whether an owner references objects that are not immortal, each is traced once however many cards it spans
+    std::unordered_map<const GcObjectContainer *, bool> holds_mortal;
+    auto trace = [&](const GcObjectContainer *ptr) {
+        auto [it, inserted] = holds_mortal.try_emplace(ptr, false);
+        if (inserted) {
+            size_t n_mortal = 0;
+            work_list.with([&](auto &wl, auto *lock) {
+                TracingContext ctx{*this, wl.least_filled()};
+                ctx.mortal_refs = &n_mortal;
+                ptr->as_tracable()->trace(Tracer{ctx});
+            });
+            it->second = n_mortal > 0;
+        }
+        return it->second;
+    };
+    auto cards = immortal_space_.dirty_cards(true);
+    for (auto &[card, owners] : cards) {
+        bool dirty = false;
+        for (auto owner : owners) {
+            if (!owner->is_immortal()) {
+                // still being constructed, its members may not all exist yet
+                dirty = true;
+                continue;
+            }
+            dirty |= trace(owner);
+        }
+        if (dirty) {
+            immortal_space_.dirty(card);
+        }
+    }
+    for (auto ptr : immortal_space_.promoted_objects()) {
+        if (!ptr->is_pointer_free()) {
+            trace(ptr);
+        }
+    }
+    stats_.n_dirty_cards = cards.size();
+    stats_.immortal_bytes = immortal_space_.used_bytes();
+}
+void GcHeap::promote_to_immortal(const GcObjectContainer *ptr) {
+    if (!ptr || ptr->is_immortal()) {
+        return;
+    }
+    auto obj = const_cast<GcObjectContainer *>(ptr);
+    if (obj->in_leaf_space()) {
+        // the pin keeps the sweep from freeing the slot and compaction from moving it
+        LeafSpace::pin(obj);
+    }
+    if (need_write_barrier()) {
+        // `scan_immortal_space` may already have run this cycle, and once the last mortal reference is overwritten
+        // nothing else would reach the object's children
+        work_list.with([&](WorkList &wl, auto *lock) {
+            shade(obj, wl.least_filled());
+        });
+    }
+    // the sweep may be looking at the object right now
+    obj->flags_.fetch_or(object_flags::IMMORTAL, std::memory_order_release);
+    immortal_space_.add_promoted(obj);
+    stats_.n_immortal_objects.fetch_add(1, std::memory_order_relaxed);
+}
+void GcHeap::release_immortal_space() {
+    auto contents = immortal_space_.release();
+    for (auto ptr : contents.objects) {
+        // the memory goes with the immortal space
+        ptr->set_alive(false);
+        if (!ptr->has_trivial_destructor()) {
+            ptr->~GcObjectContainer();
+        }
+    }
+    for (auto ptr : contents.promoted) {
+        ptr->flags_.fetch_and(static_cast<uint8_t>(~object_flags::IMMORTAL), std::memory_order_relaxed);
+        if (ptr->in_leaf_space()) {
+            LeafSpace::unpin(ptr);
+        }
+    }
+    // the final collection frees the promoted objects like any other
+    auto &lists = object_lists_.get().lists;
+    for (auto ptr : contents.unlinked) {
+        ptr->set_color(color::WHITE);
+        lists.at(std::min<size_t>(ptr->pool_idx(), lists.size() - 1))->with([&](ObjectList &list, auto *lock) {
+            list.insert(ptr);
+        });
+    }
+    stats_.n_immortal_objects = 0;
+}
+void GcHeap::teardown() {
+    size_t n = 0;
+    for (auto &list : object_lists_.get().lists) {
+        list->with([&](ObjectList &list, auto *lock) {
+            // destructors may still give buffers back to the pools, which are all alive until the heap is
+            for (auto ptr = list.head; ptr;) {
+                auto next = ptr->next_;
+                ptr->set_alive(false);
+                if (!ptr->has_trivial_destructor()) {
+                    ptr->~GcObjectContainer();
+                }
+                ptr = next;
+                n++;
+            }
+            list.head = nullptr;
+            list.count = 0;
+        });
+    }
+    n += leaf_space_.with([&](LeafSpace &space, auto *lock) {
+        return space.finalize_all();
+    });
+    stats_.n_collected.fetch_add(n, std::memory_order_relaxed);
+}
+namespace {
+struct ImageHeader {
+    uint64_t magic;
+    uint64_t version;
+    // tells images written by another build apart, their vtables are elsewhere
+    uint64_t fingerprint;
+    // where `image_anchor` was in the process that wrote the image, vtable pointers move along with it
+    uint64_t anchor;
+    uint64_t root_type;
+    uint64_t root;
+    uint64_t n_objects;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t n_relocations;
+};
+constexpr uint64_t image_magic = 0x4547414d49434721;// "!GCIMAGE"
+constexpr uint64_t image_version = 1;
+// the objects keep their alignment as long as it is at most this, the mapping itself is page aligned
+constexpr uint64_t image_data_offset = 4096;
+void image_anchor() {}
+uint64_t image_anchor_address() {
+    return reinterpret_cast<uintptr_t>(&image_anchor);
+}
+uint64_t image_fingerprint() {
+    return (reinterpret_cast<uintptr_t>(&typeid(GcString)) - image_anchor_address()) ^ (uint64_t(sizeof(GcObjectContainer)) << 48);
+}
+uint64_t align_up(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+}// namespace
+uint64_t ImageWriter::copy(const void *src, size_t size, size_t alignment) {
+    GC_ASSERT(alignment <= image_data_offset, "Alignment too large for an image");
+    auto offset = align_up(data_.size(), alignment);
+    data_.resize(offset + size);
+    std::memcpy(data_.data() + offset, src, size);
+    return offset;
+}
+uint64_t ImageWriter::translate(const void *src) const {
+    auto p = static_cast<const std::byte *>(src);
+    for (auto &range : ranges_) {
+        if (p >= range.begin && p < range.end) {
+            return range.offset + (p - range.begin);
+        }
+    }
+    GC_ASSERT(false, "Reference outside of its object and the buffers handed to the image writer");
+    return 0;
+}
+uint64_t ImageWriter::enqueue(const GcObjectContainer *obj) {
+    // the offset is known once the object is copied
+    auto [it, inserted] = offsets_.try_emplace(obj, std::numeric_limits<uint64_t>::max());
+    if (inserted) {
+        pending_.push_back(obj);
+    }
+    return it->second;
+}
+void ImageWriter::buffer_bytes(const void *field, size_t bytes, size_t alignment) {
+    auto buffer = *static_cast<const void *const *>(field);
+    if (!buffer || bytes == 0) {
+        return;
+    }
+    auto offset = copy(buffer, bytes, alignment);
+    ranges_.push_back(Range{static_cast<const std::byte *>(buffer), static_cast<const std::byte *>(buffer) + bytes, offset});
+    auto slot = translate(field);
+    write_word(slot, offset);
+    relocations_.push_back(slot);
+}
+void ImageWriter::reference(const void *slot, const GcObjectContainer *target, ptrdiff_t adjust) {
+    if (!target) {
+        return;
+    }
+    fixups_.push_back(Fixup{translate(slot), target, adjust});
+    enqueue(target);
+}
+void ImageWriter::write_object(const GcObjectContainer *obj) {
+    GC_ASSERT(obj->flags_.load(std::memory_order_relaxed) & object_flags::IMAGEABLE, "Object can not be written to an image, see `is_imageable`");
+    auto offset = copy(obj, obj->allocation_size(), obj->allocation_alignment());
+    offsets_[obj] = offset;
+    // the copy is immortal and black from the start, and belongs to no list, root set or page
+    auto copy = reinterpret_cast<GcObjectContainer *>(data_.data() + offset);
+    copy->color_.store(color::BLACK, std::memory_order_relaxed);
+    copy->alive = true;
+    copy->pool_idx_ = static_cast<uint8_t>(GcHeap::immortal_pool_idx);
+    copy->flags_.store((obj->flags_.load(std::memory_order_relaxed) & (object_flags::POINTER_FREE | object_flags::TRIVIAL_DESTRUCTOR | object_flags::IMAGEABLE)) |
+                           object_flags::IMMORTAL | object_flags::IN_IMAGE,
+                       std::memory_order_relaxed);
+    copy->root_ref_count.store(0, std::memory_order_relaxed);
+    copy->rooted_ = false;
+    copy->pin_count_.store(0, std::memory_order_relaxed);
+    copy->root_node = {};
+    copy->next_ = nullptr;
+    // the vtable pointer of the gc base, at the start of the object
+    relocations_.push_back(offset | vtable_tag);
+    auto begin = reinterpret_cast<const std::byte *>(obj);
+    ranges_.assign({Range{begin, begin + obj->allocation_size(), offset}});
+    obj->write_image(*this);
+    if (!obj->is_pointer_free()) {
+        if (auto traceable = obj->as_tracable()) {
+            TracingContext ctx{heap_, 0};
+            ctx.image = this;
+            traceable->trace(Tracer{ctx});
+        }
+    }
+}
+uint64_t ImageWriter::write(const GcObjectContainer *root) {
+    enqueue(root);
+    // breadth first, so that objects end up near their siblings
+    for (size_t i = 0; i < pending_.size(); i++) {
+        write_object(pending_[i]);
+    }
+    for (auto &fixup : fixups_) {
+        write_word(fixup.slot, offsets_.at(fixup.target) + fixup.adjust);
+        relocations_.push_back(fixup.slot);
+    }
+    pending_.clear();
+    fixups_.clear();
+    return offsets_.at(root);
+}
+bool GcHeap::save_image(const GcObjectContainer *root, ptrdiff_t adjust, size_t root_type, const std::string &path) {
+    ImageWriter writer(*this);
+    auto root_offset = writer.write(root);
+    auto data = writer.data();
+    auto relocations = writer.relocations();
+    ImageHeader header{
+        .magic = image_magic,
+        .version = image_version,
+        .fingerprint = image_fingerprint(),
+        .anchor = image_anchor_address(),
+        .root_type = root_type,
+        .root = root_offset + adjust,
+        .n_objects = writer.object_count(),
+        .data_offset = image_data_offset,
+        .data_size = data.size(),
+        .n_relocations = relocations.size(),
+    };
+    auto file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    // zeros for the gap before the data, and for the one after it
+    std::vector<std::byte> padding(image_data_offset);
+    auto ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(padding.data(), 1, image_data_offset - sizeof(header), file) == image_data_offset - sizeof(header) &&
+              std::fwrite(data.data(), 1, data.size(), file) == data.size() &&
+              std::fwrite(padding.data(), 1, align_up(data.size(), sizeof(uint64_t)) - data.size(), file) == align_up(data.size(), sizeof(uint64_t)) - data.size() &&
+              std::fwrite(relocations.data(), sizeof(uint64_t), relocations.size(), file) == relocations.size();
+    return std::fclose(file) == 0 && ok;
+}
+void *GcHeap::load_image(const std::string &path, size_t root_type) {
+    size_t size = 0;
+    auto base = static_cast<std::byte *>(detail::os_map_file(path, size));
+    if (!base) {
+        return nullptr;
+    }
+    ImageHeader header{};
+    if (size >= sizeof(header)) {
+        std::memcpy(&header, base, sizeof(header));
+    }
+    auto reject = [&] {
+        detail::os_unmap_file(base, size);
+        return nullptr;
+    };
+    // in this order, so that none of the sums can overflow
+    if (header.magic != image_magic || header.version != image_version || header.fingerprint != image_fingerprint() ||
+        header.root_type != root_type || header.data_offset > size || header.data_size > size - header.data_offset ||
+        header.root >= header.data_size) {
+        return reject();
+    }
+    auto relocations_offset = header.data_offset + align_up(header.data_size, sizeof(uint64_t));
+    if (relocations_offset > size || header.n_relocations > (size - relocations_offset) / sizeof(uint64_t)) {
+        return reject();
+    }
+    auto data = base + header.data_offset;
+    auto relocations = reinterpret_cast<const uint64_t *>(base + relocations_offset);
+    auto module_delta = image_anchor_address() - header.anchor;
+    // everything at once, the pages with no pointer in them are never copied. a word outside of the data means a
+    // corrupted image, which was only ever written to the private copy of the pages
+    for (size_t i = 0; i < header.n_relocations; i++) {
+        auto relocation = relocations[i];
+        auto offset = relocation & ~ImageWriter::vtable_tag;
+        if (header.data_size < sizeof(uint64_t) || offset > header.data_size - sizeof(uint64_t)) {
+            return reject();
+        }
+        auto word = data + offset;
+        uint64_t value;
+        std::memcpy(&value, word, sizeof(value));
+        value += relocation & ImageWriter::vtable_tag ? module_delta : reinterpret_cast<uintptr_t>(data);
+        std::memcpy(word, &value, sizeof(value));
+    }
+    // a writable image would let stores into it bypass the barrier
+    if (!detail::os_protect_readonly(base, size)) {
+        return reject();
+    }
+    images_.with([&](auto &images, auto *lock) {
+        images.push_back(MappedImage{base, size});
+    });
+    stats_.n_image_objects.fetch_add(header.n_objects, std::memory_order_relaxed);
+    stats_.image_bytes.fetch_add(header.data_size, std::memory_order_relaxed);
+    return data + header.root;
+}
+void GcHeap::unmap_images() {
+    images_.with([&](auto &images, auto *lock) {
+        for (auto &image : images) {
+            detail::os_unmap_file(image.base, image.size);
+        }
+        images.clear();
+    });
+}
+void GcHeap::enqueue_finalizers(std::vector<GcObjectContainer *> &objects) {
+    if (objects.empty()) {
+        return;
+    }
+    finalization_queue_.with([&](auto &queue, auto *lock) {
+        queue.insert(queue.end(), objects.begin(), objects.end());
+    });
+    pending_finalizers_.fetch_add(objects.size(), std::memory_order_release);
+    {
+        // taking the mutex orders the update above with the finalizer's predicate check, so the wakeup is not lost
+        std::lock_guard<std::mutex> lock(finalizer_mutex_);
+    }
+    finalizer_wakeup_.notify_one();
+}
+size_t GcHeap::run_finalizers() {
+    std::vector<GcObjectContainer *> objects;
+    finalization_queue_.with([&](auto &queue, auto *lock) {
+        std::swap(objects, queue);
+    });
+    if (objects.empty()) {
+        return 0;
+    }
+    auto &resources = pool_.get().concurrent_resources;
+    std::vector<std::vector<DeadObject>> batches(resources.size());
+    std::vector<GcObjectContainer *> leaf_slots;
+    size_t freed_bytes = 0;
+    for (auto ptr : objects) {
+        if (ptr->in_leaf_space()) {
+            ptr->~GcObjectContainer();
+            leaf_slots.push_back(ptr);
+            continue;
+        }
+        auto pool_idx = ptr->pool_idx_;
+        DeadObject dead{ptr, ptr->allocation_size(), ptr->allocation_alignment()};
+        ptr->~GcObjectContainer();
+        freed_bytes += dead.size;
+        auto &batch = batches[pool_idx];
+        batch.push_back(dead);
+        if (batch.size() == free_batch_size) {
+            free_objects(batch, pool_idx);
+        }
+    }
+    for (size_t i = 0; i < batches.size(); i++) {
+        if (!batches[i].empty()) {
+            free_objects(batches[i], i);
+        }
+    }
+    if (!leaf_slots.empty()) {
+        leaf_space_.with([&](LeafSpace &space, auto *lock) {
+            freed_bytes += space.release(leaf_slots);
+        });
+    }
+    pool_.get().release(freed_bytes);
+    stats_.n_finalized.fetch_add(objects.size(), std::memory_order_relaxed);
+    pending_finalizers_.fetch_sub(objects.size(), std::memory_order_release);
+    return objects.size();
+}
+void GcHeap::finish_finalization() {
+    // another thread may hold a batch it has not released yet, wait for that as well
+    while (pending_finalizers_.load(std::memory_order_acquire) > 0) {
+        if (run_finalizers() == 0) {
+            detail::pause_thread();
+        }
+    }
+}
+void GcHeap::background_finalizer() {
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(finalizer_mutex_);
+            finalizer_wakeup_.wait(lock, [this] {
+                return stop_finalizer_ || pending_finalizers_.load(std::memory_order_acquire) > 0;
+            });
+            if (stop_finalizer_ && pending_finalizers_.load(std::memory_order_acquire) == 0) {
+                return;
+            }
+        }
+        run_finalizers();
+    }
+}
 void GcHeap::collect() {
 
     auto t = time_function([&]() {
@@ -500,6 +2238,9 @@ void GcHeap::collect() {
             }
         });
         work_list.get().clear();
+        leaf_space_.with([](LeafSpace &space, auto *lock) {
+            space.clear_marks();
+        });
         if (mode_ != GcMode::CONCURRENT) {
             state() = State::MARKING;
         }
@@ -532,7 +2273,50 @@ void GcHeap::collect() {
         std::printf("full collection took %f ms\n", t * 1e3);
     }
     stats_.collection_time.update(t);
+    update_heap_limit(t);
     stats_.n_collection_cycles.fetch_add(1, std::memory_order_relaxed);
     stats_.incremental_time = 0;
 }
+void GcHeap::update_heap_limit(double cycle_time) {
+    auto now = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration<double>(now - last_cycle_end_).count();
+    last_cycle_end_ = now;
+    if (!adaptive_heap_ || (mode_ == GcMode::CONCURRENT && stats_.n_collection_cycles == 0)) {
+        // the first concurrent cycle has no baseline to tell its live set by
+        return;
+    }
+    auto limit = heap_limit_.load();
+    auto live = live_set_.load();
+    auto live_ratio = static_cast<double>(live) / limit;
+    auto gc_cpu = elapsed > 0.0 ? cycle_time / elapsed : 0.0;
+    // aim for a heap where the live set takes up the target ratio, moving by at most the growth factor at a time
+    auto target = static_cast<size_t>(live / heap_target_live_ratio_);
+    if (live_ratio < heap_shrink_ratio_) {
+        // a mostly free heap goes first: with so little to mark, the cost of a cycle is the sweep of what was
+        // allocated since the last one, and a larger heap would not make it any cheaper
+        resize_heap(std::max(target, static_cast<size_t>(limit / heap_growth_factor_)), gc_cpu);
+    } else if (live_ratio > heap_target_live_ratio_ || gc_cpu > gc_cpu_budget_) {
+        resize_heap(std::max(target, static_cast<size_t>(limit * heap_growth_factor_)), gc_cpu);
+    }
+}
+void GcHeap::take_cycle_baseline() {
+    freed_at_cycle_start_ = pool_.get().freed_size_.load();
+    allocation_at_cycle_start_ = pool_.get().allocation_size_.load();
+}
+void GcHeap::resize_heap(size_t new_limit, double gc_cpu) {
+    new_limit = std::clamp(new_limit, min_heap_size_, max_heap_size_);
+    auto old_limit = heap_limit_.exchange(new_limit);
+    if (new_limit == old_limit) {
+        return;
+    }
+    if (new_limit > old_limit) {
+        stats_.n_heap_grows++;
+    } else {
+        stats_.n_heap_shrinks++;
+    }
+    stats_.heap_resizes.push_back(GcStats::HeapResize{stats_.n_collection_cycles.load(), old_limit, new_limit, pool_.get().allocation_size_.load(), gc_cpu});
+    if constexpr (verbose_output) {
+        std::printf("heap limit %lldB -> %lldB\n", old_limit, new_limit);
+    }
+}
 }// namespace gc
\ No newline at end of file
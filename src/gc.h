@@ -5,6 +5,7 @@
 #include <utility>
 #include <deque>
 #include <unordered_set>
+#include <unordered_map>
 #include <stacktrace>
 #include <iostream>
 #include <optional>
@@ -16,9 +17,17 @@
 #endif
 #include <mutex>
 #include <list>
+#include <map>
 #include <barrier>
 #include <condition_variable>
 #include <cstring>
+#include <bit>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <typeinfo>
+#include <array>
 #include "pmr-mimalloc.h"
 
 static_assert(sizeof(size_t) == 8, "64-bit only");
@@ -265,12 +274,37 @@ public:
         return data;
     }
 };
+/// @brief memory straight from the OS, so that it can be given back page by page.
+/// `os_reserve` takes address space only, `os_commit` makes a part of it usable and `os_decommit` drops the physical
+/// pages again while the range stays reserved. On Linux the reserved range is accessible outside of debug builds,
+/// committing is a no-op there and decommitted pages read back as zeros
+void *os_map(size_t size, size_t alignment);
+void *os_reserve(size_t size, size_t alignment);
+void os_unmap(void *ptr, size_t size);
+void os_commit(void *ptr, size_t size);
+void os_decommit(void *ptr, size_t size);
+/// @brief resident set size of the process, 0 where the OS does not tell
+size_t os_resident_bytes();
 }// namespace detail
 class GcHeap;
+namespace detail {
+/// the heap of the innermost `HeapScope` on this thread, see `get_heap`
+extern constinit thread_local GcHeap *current_heap;
+/// the heap set up by `GcHeap::init`
+extern GcHeap *default_heap;
+}// namespace detail
 class GcObjectContainer;
+class ImageWriter;
 struct TracingContext {
     GcHeap &heap;
     size_t pool_idx;
+    /// set while compaction fixes up references: members are pointed at the new copy of forwarded objects
+    /// instead of being shaded
+    bool relocating = false;
+    /// set while immortal objects are traced, counts the references into the collected heap
+    size_t *mortal_refs = nullptr;
+    /// set while a heap image is written, the references are handed to the writer instead of being shaded
+    ImageWriter *image = nullptr;
     explicit TracingContext(GcHeap &heap, size_t pool_idx) : heap(heap), pool_idx(pool_idx) {}
     void shade(const GcObjectContainer *ptr) const noexcept;
 };
@@ -292,6 +326,24 @@ constexpr uint8_t WHITE = 0;
 constexpr uint8_t GRAY = 1;
 constexpr uint8_t BLACK = 2;
 }// namespace color
+namespace object_flags {
+/// the object holds no reference to other gc objects, so there is nothing to trace
+constexpr uint8_t POINTER_FREE = 1;
+/// the object lives in the `LeafSpace`. it is marked in the page bitmap and `color_` stays white
+constexpr uint8_t LEAF = 2;
+/// the destructor does nothing, dead objects are released without calling it
+constexpr uint8_t TRIVIAL_DESTRUCTOR = 4;
+/// the object may be moved with a plain copy of its bytes by compaction
+constexpr uint8_t RELOCATABLE = 8;
+/// compaction moved the object, `next_` holds the new copy until the references have been fixed up
+constexpr uint8_t FORWARDED = 16;
+/// the object lives as long as the heap and is no longer swept, see `ImmortalSpace`
+constexpr uint8_t IMMORTAL = 32;
+/// the object lives in a heap image mapped read-only by `load_image`. it is never rooted, pinned or written to
+constexpr uint8_t IN_IMAGE = 64;
+/// the object may be written to a heap image, see `is_imageable`
+constexpr uint8_t IMAGEABLE = 128;
+}// namespace object_flags
 
 struct RootSet {
     std::list<const GcObjectContainer *> roots;
@@ -319,14 +371,27 @@ class GcObjectContainer {
     friend class Local;
     template<class T>
     friend class GcPtr;
+    template<class T>
+    friend class Pin;
+    friend class ImageWriter;
 protected:
     friend class GcHeap;
+    friend class LeafSpace;
+    friend class PoolSpace;
     mutable std::atomic<uint8_t> color_ = color::WHITE;
     mutable bool alive = true;
     uint8_t pool_idx_;
+    // atomic only because `promote_to_immortal` sets a flag on a published object, which the sweep may be reading
+    std::atomic<uint8_t> flags_ = 0;
+    /// size and log2 alignment of the allocation, recorded by the heap so that freeing needs no virtual call
+    uint32_t alloc_size_ = 0;
     mutable std::atomic<uint16_t> root_ref_count = 0;
-    /// @brief if we were using rust, the below field might only take 8 bytes...
-    mutable std::optional<RootSet::Node> root_node = {};
+    uint8_t alloc_align_log2_ = 0;
+    /// whether `root_node` is currently an entry of the root set
+    mutable bool rooted_ = false;
+    /// number of live `Pin`s, a pinned object is never moved
+    mutable std::atomic<uint16_t> pin_count_ = 0;
+    mutable RootSet::Node root_node = {};
     mutable GcObjectContainer *next_ = nullptr;
 
     void set_alive(bool value) const {
@@ -347,11 +412,42 @@ public:
     }
     bool is_root() const {
         // return root_ref_count > 0;
-        return root_node.has_value();
+        return rooted_;
     }
     uint8_t color() const {
         return color_.load(std::memory_order_relaxed);
     }
+    bool is_pointer_free() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::POINTER_FREE;
+    }
+    bool in_leaf_space() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::LEAF;
+    }
+    bool has_trivial_destructor() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::TRIVIAL_DESTRUCTOR;
+    }
+    bool is_relocatable() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::RELOCATABLE;
+    }
+    bool is_pinned() const {
+        return pin_count_.load(std::memory_order_acquire) > 0;
+    }
+    bool is_immortal() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::IMMORTAL;
+    }
+    bool in_image() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::IN_IMAGE;
+    }
+    /// the new copy of an object moved by compaction, null if it has not moved
+    const GcObjectContainer *forwarding_address() const {
+        return flags_.load(std::memory_order_relaxed) & object_flags::FORWARDED ? next_ : nullptr;
+    }
+    size_t allocation_size() const {
+        return alloc_size_;
+    }
+    size_t allocation_alignment() const {
+        return size_t(1) << alloc_align_log2_;
+    }
     bool is_alive() const {
         return alive;
     }
@@ -361,9 +457,29 @@ public:
     }
     virtual size_t object_size() const = 0;
     virtual size_t object_alignment() const = 0;
+    /// hands the out-of-line buffers of the object to `ImageWriter::buffer`, objects without any have nothing to do
+    virtual void write_image(ImageWriter &) const {}
 };
 template<class T>
 concept is_traceable = std::is_base_of<Traceable, T>::value;
+/// @brief objects that never reference other gc objects. they are blackened as soon as they are reached
+/// and never go through the work list. a traceable class with an empty `trace` opts in with
+/// `static constexpr bool gc_pointer_free = true;`
+template<class T>
+concept is_pointer_free = !is_traceable<T> || requires { requires T::gc_pointer_free; };
+/// @brief destroying a T does nothing beyond the (empty) GcObjectContainer destructor, so dead objects
+/// can be dropped without calling it. opt in with `static constexpr bool gc_trivially_destructible = true;`
+template<class T>
+concept is_trivially_finalizable = requires { requires T::gc_trivially_destructible; };
+/// @brief a T can be moved by copying its bytes, nothing points into it but gc references.
+/// Only such objects are moved by compaction, opt in with `static constexpr bool gc_trivially_relocatable = true;`
+template<class T>
+concept is_trivially_relocatable = requires { requires T::gc_trivially_relocatable; };
+/// @brief a T can be written to a heap image and mapped back by another run of the same binary: besides its gc
+/// references, it only points into the buffers it hands over in `write_image`, and the gc base holds its only
+/// vtable pointer. Trivially relocatable objects qualify, others opt in with `static constexpr bool gc_imageable = true;`
+template<class T>
+concept is_imageable = is_trivially_relocatable<T> || requires { requires T::gc_imageable; };
 class Traceable : public GcObjectContainer {
 public:
     virtual void trace(const Tracer &) const = 0;
@@ -407,6 +523,536 @@ inline const char *to_string(GcMode mode) {
     }
     return "UNKNOWN";
 }
+class RegionSpace;
+/// @brief Segregated-fit space for small pointer-free objects.
+/// Objects are carved out of `page_size`-aligned pages holding a single size class each, so the page
+/// (and its bitmaps) is found by masking the object address. Marking sets a bit in the page's mark bitmap and
+/// sweeping is a bitmap operation, destructors only run for slots allocated with `needs_destructor`.
+/// A fresh slot stays pinned until `unpin`, so a collection triggered from inside its constructor can't free it.
+/// `evacuate` empties sparse pages into the free slots of the others, see `GcOption::compaction`
+class LeafSpace {
+public:
+    static constexpr size_t page_size = 64 * 1024;
+    static constexpr std::array<uint32_t, 6> size_classes = {48, 64, 96, 128, 192, 256};
+    static constexpr size_t max_object_size = size_classes.back();
+    static constexpr size_t max_object_alignment = 16;
+    static constexpr size_t no_size_class = size_classes.size();
+private:
+    static constexpr size_t max_slots = page_size / size_classes.front();
+    static constexpr size_t bitmap_words = (max_slots + 63) / 64;
+    struct Page {
+        uint32_t slot_size;
+        uint32_t n_slots;
+        uint32_t n_used = 0;
+        uint32_t cursor = 0;// first bitmap word that might have a free slot
+        std::array<uint64_t, bitmap_words> alloc_bits{};
+        std::array<uint64_t, bitmap_words> destructor_bits{};
+        std::array<std::atomic<uint64_t>, bitmap_words> mark_bits{};
+        std::array<std::atomic<uint64_t>, bitmap_words> pinned_bits{};
+        static constexpr size_t slots_offset = 64 * ((sizeof(uint32_t) * 4 + sizeof(uint64_t) * bitmap_words * 4 + 63) / 64);
+        std::byte *slot(size_t idx) {
+            return reinterpret_cast<std::byte *>(this) + slots_offset + idx * slot_size;
+        }
+        size_t index_of(const void *ptr) const {
+            return (reinterpret_cast<const std::byte *>(ptr) - reinterpret_cast<const std::byte *>(this) - slots_offset) / slot_size;
+        }
+        uint64_t valid_mask(size_t word) const {
+            auto first = word * 64;
+            return n_slots - first >= 64 ? ~0ull : (1ull << (n_slots - first)) - 1;
+        }
+    };
+    static_assert(sizeof(Page) <= Page::slots_offset, "page header overlaps the slots");
+    std::array<std::vector<Page *>, size_classes.size()> pages_;
+    std::array<size_t, size_classes.size()> cursors_{};
+    // pages are regions of the heap's `RegionSpace`
+    RegionSpace *regions_;
+    // pages emptied by a sweep stay committed for a while, in the order they were emptied, before they go back to
+    // the region space. they are reused before taking new regions
+    struct FreePage {
+        Page *page;
+        size_t freed_at;
+    };
+    std::vector<FreePage> free_pages_;
+    // pages emptied by `evacuate`, their slots hold the forwarding addresses until `finish_evacuation`
+    std::vector<Page *> evacuated_;
+    size_t n_sweeps_ = 0;
+    static bool is_movable(Page *page);
+    Page *new_page();
+    static Page *page_of(const void *ptr) {
+        return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(ptr) & ~(page_size - 1));
+    }
+    static void *allocate_from(Page *page, bool needs_destructor);
+public:
+    static size_t size_class_of(size_t size) {
+        for (size_t i = 0; i < size_classes.size(); i++) {
+            if (size <= size_classes[i]) {
+                return i;
+            }
+        }
+        return no_size_class;
+    }
+    explicit LeafSpace(RegionSpace *regions) : regions_(regions) {}
+    LeafSpace(const LeafSpace &) = delete;
+    LeafSpace &operator=(const LeafSpace &) = delete;
+    ~LeafSpace();
+    void *allocate(size_t size_class, bool needs_destructor);
+    static void mark(const GcObjectContainer *ptr) {
+        auto page = page_of(ptr);
+        auto idx = page->index_of(ptr);
+        page->mark_bits[idx / 64].fetch_or(1ull << (idx % 64), std::memory_order_relaxed);
+    }
+    static void pin(const GcObjectContainer *ptr) {
+        auto page = page_of(ptr);
+        auto idx = page->index_of(ptr);
+        page->pinned_bits[idx / 64].fetch_or(1ull << (idx % 64), std::memory_order_release);
+    }
+    static void unpin(const GcObjectContainer *ptr) {
+        auto page = page_of(ptr);
+        auto idx = page->index_of(ptr);
+        page->pinned_bits[idx / 64].fetch_and(~(1ull << (idx % 64)), std::memory_order_release);
+    }
+    static bool is_marked(const GcObjectContainer *ptr) {
+        auto page = page_of(ptr);
+        auto idx = page->index_of(ptr);
+        return page->mark_bits[idx / 64].load(std::memory_order_relaxed) & (1ull << (idx % 64));
+    }
+    /// the allocated slot holding `ptr`, null if `ptr` is in a free slot or the page header
+    static const GcObjectContainer *object_at(const void *ptr);
+    /// frees every allocated but unmarked slot and clears the marks for the next cycle.
+    /// returns the number of objects and bytes freed.
+    /// With `deferred`, dead slots that need a destructor are not freed but pinned and handed out instead,
+    /// they are returned with `release` once finalized
+    std::pair<size_t, size_t> sweep(std::vector<GcObjectContainer *> *deferred = nullptr);
+    /// frees slots deferred by `sweep` whose destructors have run, returns the bytes freed
+    size_t release(std::span<GcObjectContainer *const> slots);
+    /// gives the pages that have stayed empty for `delay` sweeps back to the OS, returns the bytes decommitted
+    size_t decommit_free_pages(size_t delay);
+    /// moves the objects of pages that are less than `threshold` full into the free slots of the other pages of
+    /// their size class, leaving a forwarding address behind. Pages holding a pinned, rooted or non-relocatable
+    /// object stay where they are. returns the number of objects moved
+    size_t evacuate(double threshold);
+    /// frees the pages emptied by `evacuate` once every reference has been fixed up, returns the number of pages
+    size_t finish_evacuation();
+    /// fraction of the committed slot memory holding objects
+    double occupancy() const;
+    /// runs the destructors of all allocated slots that need one and forgets them, the pages stay mapped until the
+    /// leaf space is destroyed. returns the number of objects dropped
+    size_t finalize_all();
+    void clear_marks();
+    size_t object_count() const;
+};
+/// @brief The memory of a pool. Objects and buffers up to `max_size` are carved out of `page_size` pages holding a
+/// single size class each, like those of the leaf space, and objects never share a page with buffers. Anything larger
+/// or more aligned gets regions of its own. A page that has been emptied goes back to the region space once it has
+/// stayed empty for `GcOption::decommit_delay` collections. A fresh object slot stays pinned until `unpin`, and
+/// `evacuate` empties sparse object pages like the leaf space does. Not thread safe, every pool has a lock of its own
+class PoolSpace : public std::pmr::memory_resource {
+public:
+    static constexpr size_t page_size = LeafSpace::page_size;
+    // 16 byte steps up to 128, then four per power of two
+    static constexpr std::array<uint32_t, 36> size_classes = {
+        16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 640, 768,
+        896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192, 10240, 12288,
+        14336, 16384};
+    static constexpr size_t max_size = size_classes.back();
+    static constexpr size_t max_alignment = 16;
+    static constexpr size_t size_class_of(size_t size) {
+        if (size <= 128) {
+            return size == 0 ? 0 : (size - 1) / 16;
+        }
+        auto log2 = std::bit_width(size - 1) - 1;
+        return 8 + (log2 - 7) * 4 + ((size - 1) >> (log2 - 2)) - 4;
+    }
+private:
+    static constexpr size_t max_slots = page_size / size_classes.front();
+    static constexpr size_t bitmap_words = (max_slots + 63) / 64;
+    struct SizeClass;
+    struct Page {
+        SizeClass *owner;
+        uint32_t slot_size;
+        uint32_t n_slots;
+        uint32_t n_used = 0;
+        uint32_t cursor = 0;// first bitmap word that might have a free slot
+        // whether the page is on the `available` stack of its size class
+        bool available = false;
+        std::array<uint64_t, bitmap_words> alloc_bits{};
+        std::array<std::atomic<uint64_t>, bitmap_words> pinned_bits{};
+        static constexpr size_t slots_offset = 64 * ((sizeof(uint64_t) * (bitmap_words * 2 + 4) + 63) / 64);
+        std::byte *slot(size_t idx) {
+            return reinterpret_cast<std::byte *>(this) + slots_offset + idx * slot_size;
+        }
+        size_t index_of(const void *ptr) const {
+            return (reinterpret_cast<const std::byte *>(ptr) - reinterpret_cast<const std::byte *>(this) - slots_offset) / slot_size;
+        }
+        uint64_t valid_mask(size_t word) const {
+            auto first = word * 64;
+            return n_slots - first >= 64 ? ~0ull : (1ull << (n_slots - first)) - 1;
+        }
+    };
+    static_assert(sizeof(Page) <= Page::slots_offset, "page header overlaps the slots");
+    struct SizeClass {
+        std::vector<Page *> pages;
+        // the pages with free slots, allocation takes the last one
+        std::vector<Page *> available;
+    };
+    std::array<SizeClass, size_classes.size()> objects_;
+    std::array<SizeClass, size_classes.size()> buffers_;
+    // pages and pass-through allocations are regions of the heap's `RegionSpace`
+    RegionSpace *regions_;
+    // without reuse a freed slot is never handed out again, see `GcOption::_full_debug`
+    bool reuse_;
+    // emptied pages stay committed for a while, in the order they were found empty, before they go back to the
+    // region space. they are reused before taking new regions
+    struct FreePage {
+        Page *page;
+        size_t freed_at;
+    };
+    std::vector<FreePage> free_pages_;
+    // pages emptied by `evacuate`, their slots hold the forwarding addresses until `finish_evacuation`
+    std::vector<Page *> evacuated_;
+    size_t n_sweeps_ = 0;
+    static bool is_movable(Page *page);
+    static bool passes_through(size_t bytes, size_t alignment) {
+        return bytes > max_size || alignment > max_alignment;
+    }
+    static Page *page_of(const void *ptr) {
+        return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(ptr) & ~(page_size - 1));
+    }
+    Page *new_page();
+    static void *allocate_from(Page *page, bool pin);
+    void *allocate_in(std::array<SizeClass, size_classes.size()> &classes, size_t bytes, size_t alignment, bool pin);
+    /// buffers
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        return allocate_in(buffers_, bytes, alignment, false);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+public:
+    PoolSpace(RegionSpace *regions, bool reuse) : regions_(regions), reuse_(reuse) {}
+    PoolSpace(const PoolSpace &) = delete;
+    PoolSpace &operator=(const PoolSpace &) = delete;
+    ~PoolSpace();
+    /// like `allocate`, from the pages that hold objects. objects are freed with `deallocate` all the same
+    void *allocate_object(size_t bytes, size_t alignment) {
+        return allocate_in(objects_, bytes, alignment, true);
+    }
+    /// lets compaction move a slot from `allocate_object` once its object is constructed and linked
+    static void unpin(const GcObjectContainer *ptr) {
+        auto page = page_of(ptr);
+        auto idx = page->index_of(ptr);
+        page->pinned_bits[idx / 64].fetch_and(~(1ull << (idx % 64)), std::memory_order_release);
+    }
+    /// takes the pages emptied since the last call out of use and gives those that have stayed empty for `delay`
+    /// calls back to the OS. called once per sweep, returns the bytes decommitted
+    size_t decommit_free_pages(size_t delay);
+    /// moves the objects of pages that are less than `threshold` full into the free slots of the other pages of
+    /// their size class, leaving a forwarding address behind. Pages holding a pinned, rooted, immortal, dying or
+    /// non-relocatable object stay where they are. returns the number of objects moved
+    size_t evacuate(double threshold);
+    /// retires the pages emptied by `evacuate` once every reference has been fixed up, returns the number of pages
+    size_t finish_evacuation();
+};
+/// @brief The address space of the heap, reserved in one piece when the heap is created and committed region by region.
+/// The pools and the leaf space use a region per page, and objects larger than `max_pooled_size` get regions of their
+/// own, so whether an address belongs to the heap is a range check. The region table tells what each region holds,
+/// and the objects carved out of pool pages set a bit in a side bitmap at their start.
+/// `object_containing` finds the object around an interior address from those two: a leaf page computes its slot, a
+/// large object starts its span, and in a pool page the start bit is at most `max_pooled_size` bytes back.
+/// The immortal space and mapped images have ranges of their own
+class RegionSpace {
+public:
+    static constexpr size_t region_size = LeafSpace::page_size;
+    // objects from the pools are at least pointer aligned
+    static constexpr size_t granule = 8;
+    /// objects up to this size come from the pools, larger ones from `allocate_large`
+    static constexpr size_t max_pooled_size = 16 * 1024;
+    enum class Kind : uint8_t {
+        FREE,
+        // a page of a `PoolSpace`, or what it passes through
+        CHUNK,
+        LARGE,
+        LEAF
+    };
+    struct Region {
+        Kind kind = Kind::FREE;
+        // the first region of the span this one belongs to
+        uint32_t first = 0;
+    };
+private:
+    std::byte *base_;
+    size_t capacity_;
+    std::unique_ptr<std::atomic<Region>[]> regions_;
+    // a bit per granule, set where an object allocated from a pool starts
+    uint64_t *starts_;
+    size_t starts_size_;
+    std::mutex mutex_;
+    // first region -> number of regions, neighbours are merged
+    std::map<size_t, size_t> free_;
+    std::atomic<size_t> committed_ = 0;
+    std::atomic<size_t> chunk_committed_ = 0;
+    size_t index_of(const void *ptr) const {
+        return (static_cast<const std::byte *>(ptr) - base_) / region_size;
+    }
+    size_t granule_of(const void *ptr) const {
+        return (static_cast<const std::byte *>(ptr) - base_) / granule;
+    }
+public:
+    explicit RegionSpace(size_t capacity);
+    RegionSpace(const RegionSpace &) = delete;
+    RegionSpace &operator=(const RegionSpace &) = delete;
+    ~RegionSpace();
+    static size_t regions_for(size_t bytes) {
+        return (bytes + region_size - 1) / region_size;
+    }
+    /// commits `n` adjacent regions, throws `std::bad_alloc` once the reservation is used up
+    std::byte *allocate_regions(size_t n, Kind kind);
+    /// decommits the span of `n` regions starting at `ptr`
+    void free_regions(void *ptr, size_t n);
+    std::byte *allocate_large(size_t bytes) {
+        return allocate_regions(regions_for(bytes), Kind::LARGE);
+    }
+    void free_large(void *ptr, size_t bytes) {
+        free_regions(ptr, regions_for(bytes));
+    }
+    /// records a pool allocated object, see `object_containing`
+    void mark_start(const void *ptr) {
+        auto g = granule_of(ptr);
+        std::atomic_ref(starts_[g / 64]).fetch_or(1ull << (g % 64), std::memory_order_release);
+    }
+    void clear_start(const void *ptr) {
+        auto g = granule_of(ptr);
+        std::atomic_ref(starts_[g / 64]).fetch_and(~(1ull << (g % 64)), std::memory_order_relaxed);
+    }
+    bool contains(const void *ptr) const {
+        auto p = static_cast<const std::byte *>(ptr);
+        return p >= base_ && p < base_ + capacity_;
+    }
+    Region region_of(const void *ptr) const {
+        return regions_[index_of(ptr)].load(std::memory_order_acquire);
+    }
+    /// the live object `ptr` points into, null if it points at free memory, a buffer or outside of the heap.
+    /// Only stable while nothing allocates or sweeps concurrently, like any other look at the object graph
+    const GcObjectContainer *object_containing(const void *ptr) const;
+    size_t committed_bytes() const {
+        return committed_.load(std::memory_order_relaxed);
+    }
+    /// the part of `committed_bytes` the pools hold, their pages and what they pass through
+    size_t chunk_committed_bytes() const {
+        return chunk_committed_.load(std::memory_order_relaxed);
+    }
+    size_t reserved_bytes() const {
+        return capacity_;
+    }
+};
+/// @brief Objects that live as long as the heap, see `make_immortal` and `promote_to_immortal`.
+/// Nothing here is swept, and nothing here is traced as a whole either: the space is one reserved range cut into
+/// cards, and the `Member` barrier dirties the card of every store landing in it. A collection traces only the
+/// owners of the members on dirty cards, and cleans the cards whose owners reference nothing but immortal objects.
+/// The buffers of immortal containers come from the same range, so their elements are covered alike.
+/// Objects promoted in place live outside of it, those holding references are traced on every cycle instead
+class ImmortalSpace : public std::pmr::memory_resource {
+public:
+    static constexpr size_t card_size = 512;
+    struct Contents {
+        std::vector<GcObjectContainer *> objects;
+        std::vector<GcObjectContainer *> promoted;
+        std::vector<GcObjectContainer *> unlinked;
+    };
+private:
+    size_t capacity_;
+    std::atomic<std::byte *> base_ = nullptr;
+    std::atomic<size_t> used_ = 0;
+    std::unique_ptr<std::atomic<uint8_t>[]> cards_;
+    // carves blocks for `pool_` out of the range, which is reserved on first use. never takes them back
+    struct Region : std::pmr::memory_resource {
+        ImmortalSpace *space;
+        std::mutex mutex;
+        explicit Region(ImmortalSpace *space) : space(space) {}
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override {}
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+    };
+    Region region_{this};
+    std::pmr::synchronized_pool_resource pool_{&region_};
+    std::mutex mutex_;
+    // the objects with members on each card. they are never freed, so a stale entry only costs a trace
+    std::unordered_map<size_t, std::vector<const GcObjectContainer *>> owners_;
+    Contents contents_;
+    size_t card_of(const void *ptr) const {
+        return (static_cast<const std::byte *>(ptr) - base_.load(std::memory_order_relaxed)) / card_size;
+    }
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        return pool_.allocate(bytes, alignment);
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        pool_.deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+public:
+    explicit ImmortalSpace(size_t capacity) : capacity_(capacity) {}
+    ImmortalSpace(const ImmortalSpace &) = delete;
+    ImmortalSpace &operator=(const ImmortalSpace &) = delete;
+    ~ImmortalSpace();
+    bool contains(const void *ptr) const {
+        auto base = base_.load(std::memory_order_acquire);
+        auto p = static_cast<const std::byte *>(ptr);
+        return base != nullptr && p >= base && p < base + capacity_;
+    }
+    /// the barrier, called for every non-null store into a `Member`
+    void record_store(const void *slot) {
+        if (contains(slot)) {
+            cards_[card_of(slot)].store(1, std::memory_order_release);
+        }
+    }
+    void dirty(size_t card) {
+        cards_[card].store(1, std::memory_order_release);
+    }
+    /// records `owner` as the object holding the member at `slot`
+    void add_member(const void *slot, const GcObjectContainer *owner);
+    void add_object(GcObjectContainer *obj);
+    void add_promoted(GcObjectContainer *obj);
+    /// a promoted object the sweep has taken off its object list
+    void add_unlinked(GcObjectContainer *obj);
+    /// the dirty cards and their owners. with `clean`, the cards are cleaned before they are returned, so that a store
+    /// racing with the scan dirties them again
+    std::vector<std::pair<size_t, std::vector<const GcObjectContainer *>>> dirty_cards(bool clean);
+    std::vector<GcObjectContainer *> promoted_objects();
+    size_t used_bytes() const {
+        return used_.load(std::memory_order_relaxed);
+    }
+    /// hands out everything that was made immortal, for the heap to tear down, and forgets about it
+    Contents release();
+};
+/// @brief Lays a reachable subgraph out as a heap image, see `save_image`. Objects are copied into the image as they
+/// are reached, each followed by the buffers its `write_image` hands over, and traced to find what else to copy.
+/// Every word the loader has to relocate is listed: the gc references and buffer pointers, which are stored as offsets
+/// into the image, and the vtable pointers, stored as they are in this process
+class ImageWriter {
+    GcHeap &heap_;
+    std::vector<std::byte> data_;
+    // offsets of the words to relocate, vtable pointers are tagged with the low bit
+    std::vector<uint64_t> relocations_;
+    std::unordered_map<const GcObjectContainer *, uint64_t> offsets_;
+    std::vector<const GcObjectContainer *> pending_;
+    // the object being written and its buffers, where the slots handed to `reference` are found
+    struct Range {
+        const std::byte *begin;
+        const std::byte *end;
+        uint64_t offset;
+    };
+    std::vector<Range> ranges_;
+    // references to objects that may not have been copied yet, patched once all are
+    struct Fixup {
+        uint64_t slot;
+        const GcObjectContainer *target;
+        ptrdiff_t adjust;
+    };
+    std::vector<Fixup> fixups_;
+    uint64_t copy(const void *src, size_t size, size_t alignment);
+    uint64_t translate(const void *src) const;
+    void write_word(uint64_t offset, uint64_t value) {
+        std::memcpy(data_.data() + offset, &value, sizeof(value));
+    }
+    uint64_t enqueue(const GcObjectContainer *obj);
+    void write_object(const GcObjectContainer *obj);
+    void buffer_bytes(const void *field, size_t bytes, size_t alignment);
+public:
+    static constexpr uint64_t vtable_tag = 1;
+    explicit ImageWriter(GcHeap &heap) : heap_(heap) {}
+    /// copies the `bytes` long buffer `field` points at behind the current object and points the copy of `field` at it
+    template<class P>
+    void buffer(P *const &field, size_t bytes) {
+        buffer_bytes(&field, bytes, alignof(P));
+    }
+    /// a gc reference of the current object held at `slot`, which stores the address of `target` plus `adjust`
+    void reference(const void *slot, const GcObjectContainer *target, ptrdiff_t adjust);
+    /// copies `root` and everything reachable from it, returns the offset of the root object
+    uint64_t write(const GcObjectContainer *root);
+    std::span<const std::byte> data() const {
+        return data_;
+    }
+    std::span<const uint64_t> relocations() const {
+        return relocations_;
+    }
+    size_t object_count() const {
+        return offsets_.size();
+    }
+};
+/// @brief entries of a `GcWeakHashMap`. The heap processes them after marking: the value of an entry is
+/// shaded only once its key has been marked, and entries whose key stays unmarked are removed
+struct EphemeronTable {
+    enum EntryState : uint8_t {
+        EMPTY,
+        FULL,
+        DELETED
+    };
+    struct Entry {
+        const GcObjectContainer *key;
+        const GcObjectContainer *value;
+        size_t hash;
+        EntryState state;
+    };
+    const GcObjectContainer *owner = nullptr;
+    Entry *entries = nullptr;
+    size_t capacity = 0;// zero or a power of two
+    size_t size = 0;
+    size_t used = 0;// full and deleted entries, the probe sequences end at empty ones
+    size_t registry_idx = 0;
+    void remove(Entry &entry) {
+        entry = Entry{nullptr, nullptr, 0, DELETED};
+        size--;
+    }
+};
+/// @brief targets of the `Weak` and `Soft` handles and the registered ephemeron tables, cleared between marking and sweeping
+struct WeakRefs {
+    struct Slot {
+        const GcObjectContainer *target;// null once cleared
+        uint64_t last_used;             // `clock` at the last access, soft references are cleared least recently used first
+        bool soft;
+    };
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    std::vector<EphemeronTable *> tables;
+    size_t n_soft = 0;
+    uint64_t clock = 0;
+    size_t acquire(const GcObjectContainer *target, bool soft) {
+        n_soft += soft;
+        auto slot = Slot{target, clock++, soft};
+        if (free_slots.empty()) {
+            slots.push_back(slot);
+            return slots.size() - 1;
+        }
+        auto idx = free_slots.back();
+        free_slots.pop_back();
+        slots[idx] = slot;
+        return idx;
+    }
+    void release(size_t idx) {
+        n_soft -= slots[idx].soft;
+        slots[idx] = Slot{nullptr, 0, false};
+        free_slots.push_back(idx);
+    }
+    const GcObjectContainer *use(size_t idx) {
+        slots[idx].last_used = clock++;
+        return slots[idx].target;
+    }
+    void add_table(EphemeronTable *table) {
+        table->registry_idx = tables.size();
+        tables.push_back(table);
+    }
+    void remove_table(EphemeronTable *table) {
+        GC_ASSERT(tables.at(table->registry_idx) == table, "Table is not registered");
+        tables.back()->registry_idx = table->registry_idx;
+        tables[table->registry_idx] = tables.back();
+        tables.pop_back();
+    }
+};
 struct WorkList {
     // std::vector<const GcObjectContainer *> list;
     using list_t = detail::LockProtected<detail::spin_lock, std::vector<const GcObjectContainer *>>;
@@ -481,8 +1127,56 @@ struct GcOption {
     GcMode mode = GcMode::INCREMENTAL;
     size_t max_heap_size = 1024 * 1024 * 1024;
     double gc_threshold = 0.8;// when should a gc be triggered
+    // the heap collects when it reaches a soft limit that starts at `initial_heap_size` and moves between
+    // `min_heap_size` and `max_heap_size` after every cycle. only `max_heap_size` is ever fatal.
+    // 0 means max_heap_size for the initial size and the initial size for the minimum, which keeps the heap fixed
+    size_t initial_heap_size = 0;
+    size_t min_heap_size = 0;
+    // the soft limit grows once the live heap after a cycle is above this fraction of it...
+    double heap_target_live_ratio = 0.5;
+    // ...or the collector took more than this fraction of the time since the previous cycle
+    double gc_cpu_budget = 0.1;
+    // and shrinks once the live heap is below this fraction of it
+    double heap_shrink_ratio = 0.2;
+    double heap_growth_factor = 2.0;
+    // memory that has stayed free for this many collections is given back to the OS: leaf and pool pages once
+    // the last slot on them is free, and the regions of large objects and buffers right away
+    size_t decommit_delay = 2;
+    // take the heap sizes from the cgroup v2 memory limit at `cgroup_path`, and collect early while the kernel
+    // reports memory pressure there
+    bool container_aware = false;
+    std::string cgroup_path = "/sys/fs/cgroup";
+    // fraction of the room left below memory.max the heap may take
+    double container_heap_fraction = 0.75;
+    // memory.pressure is read every `pressure_poll_ms`. the next collection is brought forward once tasks
+    // have stalled on memory for more than this fraction of the time in between
+    double memory_pressure_threshold = 0.05;
+    size_t pressure_poll_ms = 100;
+    // after every collection, move the small objects out of leaf and pool pages that are less than
+    // `compaction_threshold` full and free those pages. only objects declaring `gc_trivially_relocatable` move,
+    // and never rooted or pinned ones, so a raw `GcPtr` to an object no `Local` or `Pin` holds does not stay
+    // valid across an allocation. stop-the-world mode only
+    bool compaction = false;
+    double compaction_threshold = 0.25;
+    // address space reserved for immortal objects and their buffers on the first `make_immortal`
+    size_t immortal_space_size = 256 * 1024 * 1024;
+    // address space reserved for the rest of the heap when it is created, committed as it is used.
+    // 0 means four times `max_heap_size` but at least 1GiB, which leaves room for the pools' slack
+    size_t reserved_address_space = 0;
+    // when the heap is destroyed, skip the final collection: only the destructors that are not trivial run, and the
+    // pools and leaf pages go back to the OS whole instead of object by object. anything still referenced is torn
+    // down along with the rest, so no `Local` or `Weak` may be used afterwards
+    bool fast_teardown = false;
+    // destroy the heap with a full collection even with `fast_teardown`, and fail if any object survives it
+    bool teardown_leak_check = false;
     bool _full_debug = false;
     std::optional<size_t> n_collector_threads = {};
+    // run non-trivial destructors of dead objects on a background thread instead of inside the sweep.
+    // their memory stays charged to the heap until the destructor has run
+    bool background_finalization = false;
+    // `Soft` references keep their targets alive while the live heap after the last collection stays below this
+    // fraction of max_heap_size. beyond it the least recently used ones are cleared, the more the fuller the heap is
+    double soft_ref_threshold = 0.5;
 };
 // namespace detail {
 // struct new_but_no_delete_memory_resouce : std::pmr::memory_resource {
@@ -532,6 +1226,32 @@ struct GcStats {
     std::atomic<size_t> n_allocated = 0;
     std::atomic<size_t> n_collected = 0;
     std::atomic<size_t> n_collection_cycles = 0;
+    std::atomic<size_t> n_finalized = 0;// objects whose destructor ran after the sweep that collected them
+    std::atomic<size_t> n_soft_refs_cleared = 0;
+    std::atomic<size_t> n_pressure_events = 0;// memory pressure reported by the cgroup
+    struct HeapResize {
+        size_t cycle = 0;
+        size_t old_limit = 0;
+        size_t new_limit = 0;
+        size_t used = 0;// heap in use when the limit moved
+        double gc_cpu = 0;// fraction of the time the collector took over the last cycle
+    };
+    std::vector<HeapResize> heap_resizes;
+    size_t n_heap_grows = 0;
+    size_t n_heap_shrinks = 0;
+    // memory the heap holds from the OS and the resident set of the process, as of the last sweep
+    std::atomic<size_t> committed_bytes = 0;
+    std::atomic<size_t> pool_committed_bytes = 0;// of that, the pools' pages and what they pass through
+    std::atomic<size_t> resident_bytes = 0;
+    std::atomic<size_t> decommitted_bytes = 0;// given back to the OS since the last reset
+    size_t n_objects_moved = 0;
+    size_t n_pages_evacuated = 0;
+    double leaf_occupancy = 1;// used fraction of the leaf pages after the last sweep, 1 - fragmentation
+    std::atomic<size_t> n_immortal_objects = 0;
+    std::atomic<size_t> immortal_bytes = 0;
+    size_t n_dirty_cards = 0;// cards of the immortal space traced by the last cycle
+    std::atomic<size_t> n_image_objects = 0;// mapped by `load_image`
+    std::atomic<size_t> image_bytes = 0;
     size_t last_collected = 0;
     std::chrono::high_resolution_clock::time_point last_collect_time = std::chrono::high_resolution_clock::now();
     StatsTracker collection_time;
@@ -547,6 +1267,18 @@ struct GcStats {
         std::printf("GC stats\n");
         std::printf("n_allocated = %lld\n", n_allocated.load());
         std::printf("n_collection_cycles = %lld\n", n_collection_cycles.load());
+        std::printf("n_finalized = %lld\n", n_finalized.load());
+        std::printf("n_soft_refs_cleared = %lld\n", n_soft_refs_cleared.load());
+        std::printf("n_pressure_events = %lld\n", n_pressure_events.load());
+        std::printf("n_heap_grows = %lld, n_heap_shrinks = %lld\n", n_heap_grows, n_heap_shrinks);
+        if (!heap_resizes.empty()) {
+            std::printf("heap limit = %lldB\n", heap_resizes.back().new_limit);
+        }
+        std::printf("committed = %lldB (pools %lldB), resident = %lldB, decommitted = %lldB\n", committed_bytes.load(),
+                    pool_committed_bytes.load(), resident_bytes.load(), decommitted_bytes.load());
+        std::printf("n_objects_moved = %lld, n_pages_evacuated = %lld, leaf_occupancy = %f\n", n_objects_moved, n_pages_evacuated, leaf_occupancy);
+        std::printf("n_immortal_objects = %lld, immortal = %lldB, n_dirty_cards = %lld\n", n_immortal_objects.load(), immortal_bytes.load(), n_dirty_cards);
+        std::printf("n_image_objects = %lld, image = %lldB\n", n_image_objects.load(), image_bytes.load());
         std::printf("mutator waiting for atomic marking = %f\n", wait_for_atomic_marking);
         std::printf("mutator waiting for pool = %f\n", time_waiting_for_pool);
         std::printf("mutator waiting for object list = %f\n", time_waiting_for_object_list);
@@ -559,6 +1291,15 @@ struct GcStats {
     void reset() {
         n_allocated = 0;
         n_collection_cycles = 0;
+        n_finalized = 0;
+        n_soft_refs_cleared = 0;
+        n_pressure_events = 0;
+        heap_resizes.clear();
+        n_heap_grows = 0;
+        n_heap_shrinks = 0;
+        decommitted_bytes = 0;
+        n_objects_moved = 0;
+        n_pages_evacuated = 0;
         incremental_time = 0;
         wait_for_atomic_marking = 0;
         time_waiting_for_pool = 0;
@@ -694,26 +1435,27 @@ class GcHeap {
     std::optional<ThreadPool> worker_pool_;
     struct Pool {
         std::atomic<size_t> allocation_size_ = 0;
+        // everything ever freed, so that what a cycle reclaimed can be told apart from what was allocated meanwhile
+        std::atomic<size_t> freed_size_ = 0;
+        void release(size_t bytes) {
+            allocation_size_.fetch_sub(bytes, std::memory_order_seq_cst);
+            freed_size_.fetch_add(bytes, std::memory_order_relaxed);
+        }
         // std::unique_ptr<std::pmr::memory_resource> inner;
-        using resouce_t = detail::LockProtected<detail::spin_lock, std::unique_ptr<std::pmr::memory_resource>>;
+        using resouce_t = detail::LockProtected<detail::spin_lock, std::unique_ptr<PoolSpace>>;
         std::vector<std::unique_ptr<resouce_t>> concurrent_resources;
         ConcurrentState concurrent_state = ConcurrentState::IDLE;
-        Pool(GcOption option) {
-            auto make = [&]() -> std::unique_ptr<std::pmr::memory_resource> {
-                if (option._full_debug) {
-                    return std::make_unique<std::pmr::monotonic_buffer_resource>();
-                } else {
-                    return std::make_unique<std::pmr::unsynchronized_pool_resource>();
-                    // return std::make_unique<mi_memory_sourece>();
-                    // inner = std::make_unique<RawHeap>();
-                }
+        /// `regions` is shared by all resources and outlives them
+        Pool(GcOption option, RegionSpace *regions) {
+            auto make = [&]() {
+                return std::make_unique<PoolSpace>(regions, !option._full_debug);
             };
             if (option.n_collector_threads.has_value()) {
                 for (size_t i = 0; i < option.n_collector_threads.value(); i++) {
                     concurrent_resources.emplace_back(std::move(std::make_unique<resouce_t>(make(), true)));
                 }
             } else {
-                concurrent_resources.emplace_back(std::move(std::make_unique<resouce_t>(make(), option.mode == GcMode::CONCURRENT)));
+                concurrent_resources.emplace_back(std::move(std::make_unique<resouce_t>(make(), option.mode == GcMode::CONCURRENT || option.background_finalization)));
             }
         }
     };
@@ -773,42 +1515,131 @@ class GcHeap {
     GcMode mode_ = GcMode::INCREMENTAL;
     size_t max_heap_size_ = 0;
     double gc_threshold_ = 0.5;
+    // soft limit, see `GcOption::initial_heap_size`
+    std::atomic<size_t> heap_limit_ = 0;
+    size_t min_heap_size_ = 0;
+    double heap_target_live_ratio_ = 0.5;
+    double gc_cpu_budget_ = 0.1;
+    double heap_shrink_ratio_ = 0.2;
+    double heap_growth_factor_ = 2.0;
+    // cycles are timed even without `enable_time_tracking` when the heap can change its size
+    bool adaptive_heap_ = false;
+    std::chrono::high_resolution_clock::time_point last_cycle_end_ = std::chrono::high_resolution_clock::now();
+    // what the last cycle did not free out of the heap at its start, see `take_cycle_baseline`
+    std::atomic<size_t> live_set_ = 0;
+    size_t allocation_at_cycle_start_ = 0;
+    size_t freed_at_cycle_start_ = 0;
+    bool background_finalization_ = false;
+    size_t decommit_delay_ = 2;
+    bool compaction_ = false;
+    double compaction_threshold_ = 0.25;
+    bool fast_teardown_ = false;
+    double soft_ref_threshold_ = 0.5;
+    std::atomic<size_t> live_after_sweep_ = 0;
+    // see `adjust_external_memory`
+    std::atomic<ptrdiff_t> external_size_ = 0;
+    std::atomic<ptrdiff_t> external_after_sweep_ = 0;
+    size_t external_growth() const {
+        auto growth = external_size_.load(std::memory_order_relaxed) - external_after_sweep_.load(std::memory_order_relaxed);
+        return growth > 0 ? static_cast<size_t>(growth) : 0;
+    }
+    /// @brief what the collection triggers go by, the heap and whatever external memory appeared since the last sweep
+    size_t trigger_size() {
+        return pool_.get().allocation_size_.load(std::memory_order_relaxed) + external_growth();
+    }
+    // set when an allocation is about to fail, the next cycle lets every soft reference go
+    std::atomic_bool clear_soft_refs_ = false;
+    std::function<void(size_t)> low_memory_handler_;
+    std::atomic_bool in_low_memory_handler_ = false;
 
     // lock order: object_list -> pool
 
+    // before everything that allocates from it
+    RegionSpace regions_;
     detail::LockProtected<detail::recursive_spinlock, Pool> pool_;
 
     detail::LockProtected<detail::spin_lock, ObjectLists> object_lists_;
     detail::LockProtected<detail::spin_lock, RootSet> root_set_;
     detail::LockProtected<detail::spin_lock, WorkList> work_list;
+    detail::LockProtected<detail::spin_lock, LeafSpace> leaf_space_;
+    ImmortalSpace immortal_space_;
+    /// files mapped by `load_image`, unmapped once the heap has stopped
+    struct MappedImage {
+        void *base;
+        size_t size;
+    };
+    detail::LockProtected<detail::spin_lock, std::vector<MappedImage>> images_;
     std::optional<std::thread> collector_thread_;
+    /// dead objects whose destructors are left to the finalizer thread, see `GcOption::background_finalization`
+    detail::LockProtected<detail::spin_lock, std::vector<GcObjectContainer *>> finalization_queue_;
+    std::atomic<size_t> pending_finalizers_ = 0;
+    std::optional<std::thread> finalizer_thread_;
+    // recursive, a weak map may allocate and collect while it holds the lock
+    detail::LockProtected<detail::recursive_spinlock, WeakRefs> weak_refs_;
+    std::mutex finalizer_mutex_;
+    std::condition_variable finalizer_wakeup_;
+    bool stop_finalizer_ = false;// guarded by finalizer_mutex_
+    /// watches the cgroup's memory.pressure, see `GcOption::container_aware`
+    std::optional<std::thread> pressure_monitor_;
+    std::mutex monitor_mutex_;
+    std::condition_variable monitor_wakeup_;
+    bool stop_monitor_ = false;// guarded by monitor_mutex_
+    std::string cgroup_path_;
+    double memory_pressure_threshold_ = 0.05;
+    size_t pressure_poll_ms_ = 100;
+    // set by the monitor, the next allocation starts a collection
+    std::atomic_bool memory_pressure_ = false;
+    void pressure_monitor(size_t initial_stall);
+    bool take_memory_pressure() {
+        return memory_pressure_.load(std::memory_order_relaxed) && memory_pressure_.exchange(false);
+    }
+    void enqueue_finalizers(std::vector<GcObjectContainer *> &objects);
+    /// run the destructors of everything queued so far and release the memory, returns the number of objects finalized
+    size_t run_finalizers();
+    /// finalize on the calling thread until nothing is pending, for when the heap is full of dead objects
+    /// the finalizer thread has not gotten to yet
+    void finish_finalization();
+    void background_finalizer();
     State state_ = State::IDLE;
     State &state() {
         GC_ASSERT(mode_ != GcMode::CONCURRENT, "State should not be accessed in concurrent mode");
         return state_;
     }
-    // free an object. *Be careful*, this function does not update the head pointer or the next pointer of the object
-    void free_object(GcObjectContainer *ptr, size_t pool_idx) {
+    /// memory of a dead object that still has to be handed back to the pool resource
+    struct DeadObject {
+        void *ptr;
+        size_t size;
+        size_t alignment;
+    };
+    static constexpr size_t free_batch_size = 256;
+    // destroy a dead object. *Be careful*, this function does not update the head pointer or the next pointer of the object.
+    // size and alignment come from the header and the destructor is skipped for trivially destructible types,
+    // so those are finalized without a single virtual call
+    DeadObject finalize_object(GcObjectContainer *ptr, size_t pool_idx) {
         GC_ASSERT(ptr->pool_idx_ == pool_idx, "Invalid pool index");
-        // if (tl_pool_idx.has_value()) {
-        //     // GC_ASSERT(tl_pool_idx.value() == pool_idx, "Invalid pool index");
-        //     printf("tl_pool_idx = %lld, pool_idx = %lld\n", tl_pool_idx.value(), pool_idx);
-        // }
-        // stats_.n_collected.fetch_add(1, std::memory_order_relaxed);
-        auto &pool = pool_.get();
-        // stats_.time_waiting_for_pool += pool_.with_timed([&](auto &pool, auto *lock) {
         if constexpr (is_debug) {
-            std::printf("freeing object %p, size=%lld, %lld/%lldB used\n", static_cast<void *>(ptr), ptr->object_size(), pool.allocation_size_.load(), max_heap_size_);
+            std::printf("freeing object %p, size=%lld, %lld/%lldB used\n", static_cast<void *>(ptr), ptr->allocation_size(), pool_.get().allocation_size_.load(), max_heap_size_);
         }
-        // pool.allocation_size_.fetch_sub(ptr->object_size(), std::memory_order_relaxed);
         ptr->set_alive(false);
-        auto size = ptr->object_size();
-        auto align = ptr->object_alignment();
-        ptr->~GcObjectContainer();
-        pool.concurrent_resources.at(pool_idx)->with([&](auto &resource, auto *lock) {
-            resource->deallocate(ptr, size, align);
+        DeadObject dead{ptr, ptr->allocation_size(), ptr->allocation_alignment()};
+        if (!ptr->has_trivial_destructor()) {
+            ptr->~GcObjectContainer();
+        }
+        return dead;
+    }
+    /// hand a batch of dead objects back to the resource of `pool_idx`, taking its lock once
+    void free_objects(std::vector<DeadObject> &batch, size_t pool_idx) {
+        pool_.get().concurrent_resources.at(pool_idx)->with([&](auto &resource, auto *lock) {
+            for (auto &dead : batch) {
+                if (dead.size > RegionSpace::max_pooled_size) {
+                    regions_.free_large(dead.ptr, dead.size);
+                    continue;
+                }
+                regions_.clear_start(dead.ptr);
+                resource->deallocate(dead.ptr, dead.size, dead.alignment);
+            }
         });
-        // });
+        batch.clear();
     }
     /// @brief `shade` it self do not acquire the lock on work_list
     /// @param ptr
@@ -824,15 +1655,23 @@ class GcHeap {
             std::printf("scanning %p from pool %lld\n", static_cast<const void *>(ptr), pool_idx);
             std::fflush(stdout);
         }
-        if (mode() != GcMode::CONCURRENT) {
-            GC_ASSERT(ptr->color() == color::GRAY || ptr->is_root(), "Object should be gray");
+        if (ptr->in_leaf_space()) {
+            LeafSpace::mark(ptr);
+            return;
         }
         if (ptr->color() == color::BLACK) {
+            // a root may be shaded by another root and then scanned as a root itself,
+            // leaving a stale (already black) entry on the work list
             return;
         }
-        auto ctx = TracingContext{*this, pool_idx};
-        if (auto traceable = ptr->as_tracable()) {
-            traceable->trace(Tracer{ctx});
+        if (mode() != GcMode::CONCURRENT) {
+            GC_ASSERT(ptr->color() == color::GRAY || ptr->is_root(), "Object should be gray");
+        }
+        if (!ptr->is_pointer_free()) {
+            auto ctx = TracingContext{*this, pool_idx};
+            if (auto traceable = ptr->as_tracable()) {
+                traceable->trace(Tracer{ctx});
+            }
         }
         ptr->set_color(color::BLACK);
     }
@@ -846,37 +1685,39 @@ class GcHeap {
             // if constexpr (is_debug) {
             //     std::printf("%lld items in work list\n", work_list.get().list.size());
             // }
-            auto [mark_end, t_mark] = time_function([this] { return !mark_some(10); });
+            auto [mark_end, t_mark] = time_function([this] { return !mark_some(10); }, adaptive_heap_);
             stats_.incremental_time += t_mark;
             if (mark_end) {
                 auto t = time_function([this] {
                     sweep();
-                });
+                }, adaptive_heap_);
                 stats_.incremental_time += t;
                 stats_.n_collection_cycles++;
                 stats_.collection_time.update(stats_.incremental_time);
+                update_heap_limit(stats_.incremental_time);
                 stats_.incremental_time = 0;
                 return;
             }
-            if (pool_.get().allocation_size_ + inc_size > max_heap_size_) {
+            if (pool_.get().allocation_size_ + inc_size > heap_limit_) {
                 auto t = time_function([this] {
                     while (mark_some(10)) {}
                     sweep();
-                });
+                }, adaptive_heap_);
                 stats_.incremental_time += t;
                 stats_.n_collection_cycles++;
                 stats_.collection_time.update(stats_.incremental_time);
+                update_heap_limit(stats_.incremental_time);
                 stats_.incremental_time = 0;
             }
             return;
         }
         GC_ASSERT(work_list.get().empty(), "Work list should be empty");
-        bool threshold_condition = pool_.get().allocation_size_ + inc_size > max_heap_size_ * gc_threshold_;
+        bool threshold_condition = trigger_size() + inc_size > heap_limit_ * gc_threshold_ || take_memory_pressure();
         if constexpr (is_debug) {
             std::printf("allocation_size_ = %llu, max_heap_size_ = %llu, inc_size = %llu\n", pool_.get().allocation_size_.load(), max_heap_size_, inc_size);
             std::printf("threshold_condition = %d\n", threshold_condition);
         }
-        if (pool_.get().allocation_size_ + inc_size > max_heap_size_) {
+        if (trigger_size() + inc_size > heap_limit_) {
             state() = State::MARKING;
             collect();
             return;
@@ -885,7 +1726,7 @@ class GcHeap {
             if constexpr (is_debug) {
                 std::printf("threshold condition\n");
             }
-            stats_.incremental_time += time_function([this] { scan_roots(); });
+            stats_.incremental_time += time_function([this] { scan_roots(); }, adaptive_heap_);
         }
     }
     struct gc_memory_resource : std::pmr::memory_resource {
@@ -928,7 +1769,7 @@ class GcHeap {
             // }
             // heap->stats_.time_waiting_for_pool += heap->pool_.with_timed([&](auto &pool, auto *lock) {
             auto &pool = heap->pool_.get();
-            pool.allocation_size_.fetch_sub(bytes + sizeof(Metadata), std::memory_order_seq_cst);
+            pool.release(bytes + sizeof(Metadata));
             if constexpr (is_debug) {
                 std::printf("Deallocating %p, %lld bytes via pmr, %lld/%lldB used\n", p, bytes, pool.allocation_size_.load(), heap->max_heap_size_);
             }
@@ -945,6 +1786,15 @@ class GcHeap {
         }
     };
     std::vector<gc_memory_resource> gc_memory_resource_;/// making gc aware of non-traceable memory usage
+    struct RetiredBuffer {
+        std::pmr::memory_resource *resource;
+        void *ptr;
+        size_t bytes;
+        size_t alignment;
+    };
+    /// out-of-line buffers dropped by live objects while the collector might still be tracing them
+    detail::LockProtected<detail::spin_lock, std::vector<RetiredBuffer>> retired_buffers_;
+    void free_retired_buffers();
     // std::condition_variable work_list_non_empty_;
     // std::condition_variable mem_available_;
     std::atomic_bool stop_collector_ = false;
@@ -960,27 +1810,120 @@ class GcHeap {
         } else if (mode_ == GcMode::CONCURRENT) {
             prepare_allocation_concurrent(inc_size);
         } else {
-            if (pool_.get().allocation_size_ + inc_size > max_heap_size_) {
+            if (trigger_size() + inc_size > heap_limit_ || take_memory_pressure()) {
                 collect();
             }
         }
+        if (mode_ != GcMode::CONCURRENT && pool_.get().allocation_size_ + inc_size > heap_limit_) {
+            if (pool_.get().allocation_size_ + inc_size <= max_heap_size_) {
+                // collecting did not make enough room below the soft limit, but there is still some below the hard one
+                resize_heap(pool_.get().allocation_size_ + inc_size, 0.0);
+            } else {
+                recover_memory(inc_size);
+            }
+        }
     }
+    /// @brief moves the soft limit after a cycle that took `cycle_time` seconds, see `GcOption::initial_heap_size`
+    void update_heap_limit(double cycle_time);
+    void resize_heap(size_t new_limit, double gc_cpu);
+    void take_cycle_baseline();
+    /// @brief the graded response to an allocation that does not fit after the regular collection: wait for
+    /// pending finalizers, collect again from scratch, collect letting every soft reference go, ask the low memory
+    /// handler. Throws `std::bad_alloc` when all of that is not enough
+    void recover_memory(size_t inc_size);
+    /// @brief runs the low memory handler unless there is none or it is already running. `pool_lock` is released
+    /// meanwhile. returns whether the handler ran
+    bool call_low_memory_handler(size_t inc_size, detail::recursive_spinlock *pool_lock);
     void concurrent_collector();
+    void start_threads(const GcOption &option);
 public:
     GcStats &stats() {
         return stats_;
     }
+    /// the `pool_idx` of objects in the immortal space, their buffers come from there as well
+    static constexpr size_t immortal_pool_idx = std::numeric_limits<uint8_t>::max();
+    /// called by every `Member` constructor, see `ImmortalSpace`
+    void note_member(const void *slot, const GcObjectContainer *owner) {
+        if (immortal_space_.contains(slot)) [[unlikely]] {
+            immortal_space_.add_member(slot, owner);
+        }
+    }
+    /// called for every non-null store into a `Member`
+    void record_store(const void *slot) {
+        immortal_space_.record_store(slot);
+    }
+    /// see `gc::promote_to_immortal`
+    void promote_to_immortal(const GcObjectContainer *ptr);
+    /// see `gc::save_image`. `adjust` is how far the root pointer is from the root object, `root_type` identifies its type
+    bool save_image(const GcObjectContainer *root, ptrdiff_t adjust, size_t root_type, const std::string &path);
+    /// see `gc::load_image`. returns the root pointer, or null when the image can not be used
+    void *load_image(const std::string &path, size_t root_type);
+    /// whether `ptr` is in the heap's reserved range, which leaves out the immortal space and mapped images
+    bool contains(const void *ptr) const {
+        return regions_.contains(ptr);
+    }
+    /// whether `ptr` is in memory this heap hands out, its reservation or its immortal space
+    bool owns(const void *ptr) const {
+        return regions_.contains(ptr) || immortal_space_.contains(ptr);
+    }
+    /// the live heap that `owns` `ptr`, null if there is none. see `heap_of`
+    static GcHeap *owner_of(const void *ptr);
+    /// the object an interior pointer points into, see `RegionSpace::object_containing`
+    const GcObjectContainer *object_containing(const void *ptr) const {
+        return regions_.object_containing(ptr);
+    }
     std::pmr::memory_resource *memory_resource(size_t pool_idx) {
         // if (pool_idx >= gc_memory_resource_.size()){
         //     printf("pool_idx = %lld, size = %lld\n", pool_idx, gc_memory_resource_.size());
         // }
         // GC_ASSERT(gc_memory_resource_[pool_idx].pool_idx == pool_idx, "Invalid pool index");
+        if (pool_idx == immortal_pool_idx) {
+            return &immortal_space_;
+        }
         pool_idx = std::min(pool_idx, gc_memory_resource_.size() - 1);
         return &gc_memory_resource_[pool_idx];
     }
     auto &root_set() {
         return root_set_;
     }
+    auto &weak_refs() {
+        return weak_refs_;
+    }
+    /// @brief the size the heap currently collects at, between `GcOption::min_heap_size` and `GcOption::max_heap_size`
+    size_t heap_limit() const {
+        return heap_limit_.load(std::memory_order_relaxed);
+    }
+    size_t max_heap_size() const {
+        return max_heap_size_;
+    }
+    /// @brief tells the heap about memory its objects hold outside of it, such as buffers of non-gc containers.
+    /// external memory that appeared since the last collection counts toward the next one, but never makes an
+    /// allocation fail
+    void adjust_external_memory(ptrdiff_t delta) {
+        external_size_.fetch_add(delta, std::memory_order_relaxed);
+    }
+    ptrdiff_t external_memory() const {
+        return external_size_.load(std::memory_order_relaxed);
+    }
+    static bool is_gc_memory_resource(const std::pmr::memory_resource *resource) {
+        return dynamic_cast<const gc_memory_resource *>(resource) != nullptr || dynamic_cast<const ImmortalSpace *>(resource) != nullptr;
+    }
+    /// @brief `handler(bytes)` is called on the allocating thread when an allocation of `bytes` still does not fit
+    /// after collecting and clearing the soft references. It should drop whatever it can spare, after which the heap
+    /// collects once more and throws `std::bad_alloc` if that was not enough either.
+    /// The handler runs without any heap lock held and is not called again while it runs
+    void set_low_memory_handler(std::function<void(size_t)> handler);
+    /// @brief whether marking has reached `ptr`. only meaningful between the end of marking and the sweep
+    static bool is_marked(const GcObjectContainer *ptr) {
+        if (ptr->is_immortal()) {
+            return true;
+        }
+        return ptr->in_leaf_space() ? LeafSpace::is_marked(ptr) : ptr->color() != color::WHITE;
+    }
+    /// @brief release an out-of-line buffer (allocated from `memory_resource`) that a live object no longer uses,
+    /// e.g. the old storage of a growing container. In concurrent mode the collector might be tracing through
+    /// the buffer right now, so it is only freed once the current cycle has finished marking
+    void retire_buffer(std::pmr::memory_resource *resource, void *ptr, size_t bytes, size_t alignment);
     GcHeap(GcOption option, gc_ctor_token_t);
     GcHeap(const GcHeap &) = delete;
     GcHeap &operator=(const GcHeap &) = delete;
@@ -989,16 +1932,34 @@ public:
     GcMode mode() const {
         return mode_;
     }
+    /// @brief sets up the default heap, the one used by threads outside of any `HeapScope`
     static void init(GcOption option = {});
     static void destroy();
+    /// @brief a heap of its own, with its own locks, threads and collection cycles. It is used through a `HeapScope`
+    /// and stopped when the last reference goes. Objects belong to the heap they were allocated from, see `heap_of`,
+    /// and may only reference objects of the same heap
+    static std::shared_ptr<GcHeap> create(GcOption option = {});
     template<class T, class... Args>
         requires std::constructible_from<T, Args...>
     auto *_new_object(std::optional<size_t> preferred_pool_idx, Args &&...args) {
+        return _new_object_sized<T>(preferred_pool_idx, sizeof(T), std::forward<Args>(args)...);
+    }
+    /// @brief allocates `size >= sizeof(T)` bytes for a `T` that keeps a variable-size tail right behind itself.
+    /// `T::object_size()` has to report the same `size`
+    template<class T, class... Args>
+    auto *_new_object_sized(std::optional<size_t> preferred_pool_idx, size_t size, Args &&...args) {
+        GC_ASSERT(size >= sizeof(T), "object should be at least sizeof(T)");
+        GC_ASSERT(size <= std::numeric_limits<uint32_t>::max(), "object too large");
         if constexpr (is_debug) {
-            std::printf("Want to allocate %lld bytes\n", sizeof(T));
+            std::printf("Want to allocate %lld bytes\n", size);
             std::fflush(stdout);
         }
-        prepare_allocation(sizeof(T));
+        // small pointer-free objects go to the leaf space, which is charged by size class
+        constexpr bool leaf_candidate = is_pointer_free<T> && alignof(T) <= LeafSpace::max_object_alignment;
+        auto size_class = leaf_candidate ? LeafSpace::size_class_of(size) : LeafSpace::no_size_class;
+        auto in_leaf = size_class != LeafSpace::no_size_class;
+        auto charged = in_leaf ? LeafSpace::size_classes[size_class] : size;
+        prepare_allocation(charged);
         size_t pool_idx{};
         auto [ptr, t] = pool_.with_timed([&](Pool &pool, auto *lock) {
             if (mode() == GcMode::CONCURRENT) {
@@ -1020,15 +1981,25 @@ public:
             } else {
                 pool_idx = object_lists_.get().least_full_list();
             }
-            GC_ASSERT(pool.allocation_size_ + sizeof(T) <= max_heap_size_, "Out of memory");
+            if (in_leaf) {
+                auto ptr = leaf_space_.with([&](LeafSpace &space, auto *lock) {
+                    return static_cast<T *>(space.allocate(size_class, !is_trivially_finalizable<T>));
+                });
+                pool.allocation_size_ += charged;
+                return ptr;
+            }
+            if (size > RegionSpace::max_pooled_size) {
+                auto ptr = reinterpret_cast<T *>(regions_.allocate_large(size));
+                pool.allocation_size_ += size;
+                return ptr;
+            }
             return pool.concurrent_resources.at(pool_idx)->with([&](auto &resource, auto *lock) {
-                auto alloc = std::pmr::polymorphic_allocator<T>(resource.get());
-                auto ptr = alloc.template allocate_object<T>(1);
+                auto ptr = static_cast<T *>(resource->allocate_object(size, alignof(T)));
                 if constexpr (is_debug) {
                     std::printf("Allocated object %p, %lld/%lldB used\n", static_cast<void *>(ptr), pool.allocation_size_.load(), max_heap_size_);
                     std::fflush(stdout);
                 }
-                pool.allocation_size_ += sizeof(T);
+                pool.allocation_size_ += size;
                 return ptr;
             });
         },
@@ -1037,10 +2008,50 @@ public:
         stats_.time_waiting_for_pool += t;
         auto offset_of_pool_idx = &reinterpret_cast<T *>(ptr)->pool_idx_ - reinterpret_cast<uint8_t *>(ptr);
         std::memcpy(reinterpret_cast<uint8_t *>(ptr) + offset_of_pool_idx, &pool_idx, sizeof(pool_idx));
-        new (ptr) T(std::forward<Args>(args)...);// avoid pmr intercepting the allocator
-        GC_ASSERT(sizeof(T) == ptr->object_size(), "size should be the same");
+        try {
+            new (ptr) T(std::forward<Args>(args)...);// avoid pmr intercepting the allocator
+        } catch (...) {
+            // the memory is in no list yet, so nothing but this would ever give it back
+            if (in_leaf) {
+                leaf_space_.with([&](LeafSpace &space, auto *lock) {
+                    GcObjectContainer *slot = reinterpret_cast<GcObjectContainer *>(ptr);
+                    space.release(std::span(&slot, 1));
+                });
+            } else if (size > RegionSpace::max_pooled_size) {
+                regions_.free_large(ptr, size);
+            } else {
+                pool_.get().concurrent_resources.at(pool_idx)->with([&](auto &resource, auto *lock) {
+                    resource->deallocate(ptr, size, alignof(T));
+                });
+            }
+            pool_.get().allocation_size_.fetch_sub(charged, std::memory_order_seq_cst);
+            stats_.n_allocated.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+        }
+        GC_ASSERT(size == ptr->object_size(), "size should be the same");
         ptr->set_alive(true);
         ptr->pool_idx_ = static_cast<uint8_t>(pool_idx);
+        ptr->alloc_size_ = static_cast<uint32_t>(size);
+        ptr->alloc_align_log2_ = static_cast<uint8_t>(std::countr_zero(alignof(T)));
+        uint8_t flags = 0;
+        if constexpr (is_pointer_free<T>) {
+            flags |= object_flags::POINTER_FREE;
+        }
+        if constexpr (is_trivially_finalizable<T>) {
+            flags |= object_flags::TRIVIAL_DESTRUCTOR;
+        }
+        if constexpr (is_trivially_relocatable<T>) {
+            flags |= object_flags::RELOCATABLE;
+        }
+        if constexpr (is_imageable<T>) {
+            flags |= object_flags::IMAGEABLE;
+        }
+        if (in_leaf) {
+            flags |= object_flags::LEAF;
+        } else if (size <= RegionSpace::max_pooled_size) {
+            regions_.mark_start(ptr);
+        }
+        ptr->flags_.store(flags, std::memory_order_relaxed);
         stats_.time_waiting_for_pool += pool_.with_timed([&](Pool &pool, auto *lock) {
             if (mode() == GcMode::CONCURRENT) {
                 stats_.wait_for_atomic_marking += time_function([&]() {
@@ -1059,6 +2070,9 @@ public:
                     shade(ptr, pool_idx);
                 });
             }
+            if (in_leaf) {
+                return;
+            }
             // possible sync issue here
             // while allocation only happens when collector is not in sweeping
             // at this line, the collector might just start sweeping
@@ -1074,10 +2088,75 @@ public:
                 });
             });
         });
+        if (in_leaf) {
+            LeafSpace::unpin(ptr);
+        } else if (size <= RegionSpace::max_pooled_size && alignof(T) <= PoolSpace::max_alignment) {
+            PoolSpace::unpin(ptr);
+        }
+        return ptr;
+    }
+    /// @brief constructs a T in the immortal space, see `make_immortal`
+    template<class T, class... Args>
+    T *_new_immortal_object(Args &&...args) {
+        auto ptr = static_cast<T *>(immortal_space_.allocate(sizeof(T), alignof(T)));
+        // set before the constructor runs, so that the containers it builds take their buffers from the immortal space
+        auto offset_of_pool_idx = &reinterpret_cast<T *>(ptr)->pool_idx_ - reinterpret_cast<uint8_t *>(ptr);
+        reinterpret_cast<uint8_t *>(ptr)[offset_of_pool_idx] = static_cast<uint8_t>(immortal_pool_idx);
+        new (ptr) T(std::forward<Args>(args)...);
+        ptr->set_alive(true);
+        ptr->pool_idx_ = static_cast<uint8_t>(immortal_pool_idx);
+        ptr->alloc_size_ = static_cast<uint32_t>(sizeof(T));
+        ptr->alloc_align_log2_ = static_cast<uint8_t>(std::countr_zero(alignof(T)));
+        uint8_t flags = 0;
+        if constexpr (is_pointer_free<T>) {
+            flags |= object_flags::POINTER_FREE;
+        }
+        if constexpr (is_trivially_finalizable<T>) {
+            flags |= object_flags::TRIVIAL_DESTRUCTOR;
+        }
+        if constexpr (is_imageable<T>) {
+            flags |= object_flags::IMAGEABLE;
+        }
+        // never shaded again, and the flag tells the card scan that the constructor is done
+        ptr->set_color(color::BLACK);
+        ptr->flags_.store(flags | object_flags::IMMORTAL, std::memory_order_release);
+        immortal_space_.add_object(ptr);
+        stats_.n_allocated.fetch_add(1, std::memory_order_relaxed);
+        stats_.n_immortal_objects.fetch_add(1, std::memory_order_relaxed);
+        stats_.immortal_bytes = immortal_space_.used_bytes();
+        if constexpr (!is_pointer_free<T>) {
+            if (mode() != GcMode::STOP_THE_WORLD) {
+                // the barrier did not shade what the constructor stored, the object was not black yet
+                work_list.with([&](auto &work_list, auto *lock) {
+                    TracingContext ctx{*this, work_list.least_filled()};
+                    ptr->trace(Tracer{ctx});
+                });
+            }
+        }
         return ptr;
     }
     void collect();
     void sweep();
+    /// evacuates sparse leaf and pool pages and points every reference to a moved object at its new copy. runs at
+    /// the end of a stop-the-world sweep, the weak references are fixed up along with the members
+    void compact();
+    /// traces the owners of the dirty cards of the immortal space and the objects promoted in place
+    void scan_immortal_space();
+    /// destroys the immortal objects and gives the promoted ones back to the collector, before the final collection
+    void release_immortal_space();
+    /// runs the destructors of every object left on the heap that has a non-trivial one and empties the object lists,
+    /// without freeing anything. the memory is released with the pools and the leaf space, see `GcOption::fast_teardown`
+    void teardown();
+    /// unmaps the files mapped by `load_image`, nothing may reference their objects anymore
+    void unmap_images();
+    /// marks the values of ephemerons with live keys until nothing changes, then clears the weak references
+    /// and ephemerons whose targets stayed unmarked. runs with `weak_refs_` locked, so no `Weak` can be
+    /// upgraded while the collector decides what is dead
+    void process_weak_references();
+    /// shades the targets of the soft references that survive this cycle, called once the roots are scanned
+    void scan_soft_refs();
+    /// empties the work list
+    void finish_marking();
     std::tuple<size_t, size_t, GcObjectContainer *, GcObjectContainer *> sweep_list(ObjectList &list, size_t pool_idx);
     void scan_roots();
     bool mark_some(size_t max_count);
@@ -1116,18 +2195,84 @@ public:
     }
 private:
     void stop() {
+        // destructors run by the final collection look the heap up
+        auto previous_heap = std::exchange(detail::current_heap, this);
+        if (pressure_monitor_.has_value()) {
+            {
+                std::lock_guard<std::mutex> lock(monitor_mutex_);
+                stop_monitor_ = true;
+            }
+            monitor_wakeup_.notify_one();
+            pressure_monitor_->join();
+        }
         stop_collector_ = true;
         if (collector_thread_.has_value()) {
             collector_thread_->join();
         }
-        collect();
-        // GC_ASSERT(object_lists_.get().head == nullptr, "Memory leak detected");
-        for (auto &list : object_lists_.get().lists) {
-            GC_ASSERT(list->get().head == nullptr, "Memory leak detected");
+        release_immortal_space();
+        if (!fast_teardown_) {
+            collect();
+        }
+        if (finalizer_thread_.has_value()) {
+            {
+                std::lock_guard<std::mutex> lock(finalizer_mutex_);
+                stop_finalizer_ = true;
+            }
+            finalizer_wakeup_.notify_one();
+            finalizer_thread_->join();
+        }
+        GC_ASSERT(pending_finalizers_ == 0, "Finalization queue should be empty");
+        if (fast_teardown_) {
+            // after the finalizer, the slots it had pending are no longer waiting for their destructors
+            teardown();
+        } else {
+            // GC_ASSERT(object_lists_.get().head == nullptr, "Memory leak detected");
+            for (auto &list : object_lists_.get().lists) {
+                GC_ASSERT(list->get().head == nullptr, "Memory leak detected");
+            }
+            GC_ASSERT(leaf_space_.get().object_count() == 0, "Memory leak detected");
         }
+        unmap_images();
+        unregister();
+        detail::current_heap = previous_heap;
+    }
+    /// leaves the heaps `owner_of` looks through
+    void unregister();
+};
+/// @brief the current heap of this thread: that of the innermost `HeapScope`, or else the one set up by `GcHeap::init`.
+/// New objects are allocated here, anything done to an existing one goes to `heap_of` it
+inline GcHeap &get_heap() {
+    auto heap = detail::current_heap;
+    if (!heap) {
+        heap = detail::default_heap;
+    }
+    GC_ASSERT(heap != nullptr, "Heap is not initialized");
+    return *heap;
+}
+/// @brief the heap `ptr` belongs to: the current one when it holds `ptr`, otherwise whichever live heap does, and the
+/// current one again for memory no heap holds. The barriers, the root set and the containers' buffers go through here,
+/// so an object touched while another heap's `HeapScope` is active still keeps to its own heap
+inline GcHeap &heap_of(const void *ptr) {
+    auto &heap = get_heap();
+    if (heap.owns(ptr)) [[likely]] {
+        return heap;
+    }
+    auto owner = GcHeap::owner_of(ptr);
+    return owner ? *owner : heap;
+}
+/// @brief makes `heap` the current heap of this thread until the scope ends, scopes nest.
+/// Threads working on heaps of their own, shards serving independent requests say, never wait for each other's locks
+/// or collections
+class HeapScope {
+    GcHeap *previous_;
+public:
+    explicit HeapScope(GcHeap &heap) : previous_(std::exchange(detail::current_heap, &heap)) {}
+    HeapScope(const HeapScope &) = delete;
+    HeapScope &operator=(const HeapScope &) = delete;
+    ~HeapScope() {
+        detail::current_heap = previous_;
     }
 };
-GcHeap &get_heap();
 namespace detail {
 inline bool check_alive(const GcObjectContainer *ptr) {
     if constexpr (is_debug) {
@@ -1144,6 +2289,9 @@ inline bool check_alive(const GcObjectContainer *ptr) {
 template<typename T>
     requires(!std::is_class_v<T>)
 struct Boxed : Traceable {
+    static constexpr bool gc_pointer_free = true;
+    static constexpr bool gc_trivially_destructible = true;
+    static constexpr bool gc_trivially_relocatable = true;
     T value;
     Boxed() = default;
     Boxed(const T &value) : value(value) {}
@@ -1156,12 +2304,77 @@ struct Boxed : Traceable {
         return alignof(Boxed<T>);
     }
 };
+namespace detail {
+template<class T>
+concept reports_capacity = requires(const T &value) {
+    typename T::value_type;
+    { value.capacity() } -> std::convertible_to<size_t>;
+};
+/// @brief memory a container owns outside of the gc heap, as far as it tells
+template<class T>
+size_t external_size(const T &value) {
+    if constexpr (reports_capacity<T>) {
+        if constexpr (requires { value.get_allocator().resource(); }) {
+            if (GcHeap::is_gc_memory_resource(value.get_allocator().resource())) {
+                // already charged to the heap
+                return 0;
+            }
+        }
+        auto bytes = value.capacity() * sizeof(typename T::value_type);
+        // small buffer optimized contents live inside the object itself
+        return bytes > sizeof(T) ? bytes : 0;
+    } else {
+        return 0;
+    }
+}
+struct no_external_size {};
+/// @brief std::pmr containers and anything else that allocates through a polymorphic allocator
+template<class T>
+concept pmr_allocator_aware = requires { typename T::allocator_type; } &&
+                              std::is_same_v<typename T::allocator_type, std::pmr::polymorphic_allocator<typename T::allocator_type::value_type>> &&
+                              std::uses_allocator_v<T, typename T::allocator_type>;
+/// @brief whether an `Adaptor<T>` built from `Args` gets the allocator of its pool, which it does unless the caller
+/// passes one
+template<class T, class... Args>
+concept binds_to_pool = pmr_allocator_aware<T> &&
+                        !(... || (std::is_convertible_v<Args, typename T::allocator_type> || std::is_same_v<std::decay_t<Args>, std::allocator_arg_t>)) &&
+                        (std::constructible_from<T, Args..., const typename T::allocator_type &> ||
+                         std::constructible_from<T, std::allocator_arg_t, const typename T::allocator_type &, Args...>);
+}// namespace detail
 template<typename T>
     requires(!is_traceable<T>)
 struct Adaptor : Traceable, T {
+    static constexpr bool gc_pointer_free = true;
+    static constexpr bool gc_trivially_destructible = std::is_trivially_destructible_v<T>;
+    // types that own memory may point into themselves
+    static constexpr bool gc_trivially_relocatable = std::is_trivially_copyable_v<T>;
     template<class... Args>
-        requires std::constructible_from<T, Args...>
-    Adaptor(Args &&...args) : T(std::forward<Args>(args)...) {}
+        requires std::constructible_from<T, Args...> && (!detail::binds_to_pool<T, Args...>)
+    Adaptor(Args &&...args) : T(std::forward<Args>(args)...) {
+        update_external_memory();
+    }
+    /// @brief allocator-aware pmr types allocate from the pool of the object that owns them, so their buffers
+    /// count toward the heap. the pool index is already set when the constructor runs
+    template<class... Args>
+        requires detail::binds_to_pool<T, Args...>
+    Adaptor(Args &&...args)
+        : T(std::make_obj_using_allocator<T>(typename T::allocator_type(heap_of(this).memory_resource(this->pool_idx())), std::forward<Args>(args)...)) {
+        update_external_memory();
+    }
+    ~Adaptor() {
+        if constexpr (detail::reports_capacity<T>) {
+            heap_of(this).adjust_external_memory(-static_cast<ptrdiff_t>(external_size_));
+        }
+    }
+    /// @brief containers report the memory they own outside of the heap when they are created, so that it counts
+    /// toward the next collection. call this after growing or shrinking one in place
+    void update_external_memory() {
+        if constexpr (detail::reports_capacity<T>) {
+            auto size = detail::external_size<T>(*this);
+            heap_of(this).adjust_external_memory(static_cast<ptrdiff_t>(size) - static_cast<ptrdiff_t>(external_size_));
+            external_size_ = size;
+        }
+    }
     void trace(const Tracer &) const override {}
     size_t object_size() const override {
         return sizeof(Adaptor<T>);
@@ -1169,6 +2382,8 @@ struct Adaptor : Traceable, T {
     size_t object_alignment() const override {
         return alignof(Adaptor<T>);
     }
+private:
+    [[no_unique_address]] std::conditional_t<detail::reports_capacity<T>, size_t, detail::no_external_size> external_size_{};
 };
 /// @brief GcPtr is an reference to a gc object
 /// @brief GcPtr should never be stored in any object, but only for passing around
@@ -1212,10 +2427,6 @@ public:
     bool operator==(std::nullptr_t) const {
         return container_ == nullptr;
     }
-    std::optional<RootSet::Node> &root_node() const {
-        static_assert(std::is_base_of_v<GcObjectContainer, T>, "T should be a subclass of GcObjectContainer");
-        return container_->root_node;
-    }
     operator bool() const {
         return container_ != nullptr;
     }
@@ -1226,6 +2437,19 @@ struct apply_trace<GcPtr<T>> {
         if (ptr.container_ == nullptr) {
             return;
         }
+        if (ctx.image) [[unlikely]] {
+            auto adjust = reinterpret_cast<const std::byte *>(ptr.container_) - reinterpret_cast<const std::byte *>(ptr.gc_object_container());
+            ctx.image->reference(&ptr, ptr.gc_object_container(), adjust);
+            return;
+        }
+        if (ctx.relocating) [[unlikely]] {
+            if (auto moved = ptr.gc_object_container()->forwarding_address()) {
+                // the base is at the same offset in both copies
+                auto delta = reinterpret_cast<const std::byte *>(moved) - reinterpret_cast<const std::byte *>(ptr.gc_object_container());
+                const_cast<GcPtr<T> &>(ptr).container_ = reinterpret_cast<T *>(reinterpret_cast<std::byte *>(ptr.container_) + delta);
+            }
+            return;
+        }
         ctx.shade(ptr.gc_object_container());
     }
 };
@@ -1238,17 +2462,19 @@ class Local {
     friend class Member;
     GcPtr<T> ptr_;
     void inc() {
-        if (ptr_.gc_object_container()) {
+        // objects in an image are never collected, and their headers are read-only
+        if (ptr_.gc_object_container() && !ptr_.gc_object_container()->in_image()) {
             ptr_.gc_object_container()->inc_root_ref_count();
             if (ptr_.gc_object_container()->root_ref_count == 1) {
                 // become a new root, add to the root set
-                auto &heap = get_heap();
+                auto &heap = heap_of(ptr_.gc_object_container());
                 heap.stats_.time_waiting_for_root_set += heap.root_set().with_timed([&](auto &rs, auto *lock) {
                     auto node = rs.add(ptr_.gc_object_container());
                     if constexpr (is_debug) {
                         std::printf("adding root %p\n", static_cast<const void *>(ptr_.gc_object_container()));
                     }
-                    ptr_.root_node().emplace(node);
+                    ptr_.gc_object_container()->root_node = node;
+                    ptr_.gc_object_container()->rooted_ = true;
                 });
                 if (ptr_.gc_object_container()->color() == color::WHITE) {
                     heap.stats_.time_waiting_for_work_list += heap.work_list.with_timed([&](auto &work_list, auto *lock) {
@@ -1259,7 +2485,7 @@ class Local {
         }
     }
     void dec() {
-        if (ptr_.gc_object_container()) {
+        if (ptr_.gc_object_container() && !ptr_.gc_object_container()->in_image()) {
             ptr_.gc_object_container()->dec_root_ref_count();
             if (ptr_.gc_object_container()->root_ref_count == 0) {
                 // remove from the root set
@@ -1267,10 +2493,10 @@ class Local {
                     std::printf("removing root %p\n", static_cast<const void *>(ptr_.gc_object_container()));
                 }
 
-                auto &heap = get_heap();
+                auto &heap = heap_of(ptr_.gc_object_container());
                 heap.stats_.time_waiting_for_root_set += heap.root_set().with_timed([&](auto &rs, auto *lock) {
-                    rs.remove(*ptr_.root_node());
-                    ptr_.root_node().reset();
+                    rs.remove(ptr_.gc_object_container()->root_node);
+                    ptr_.gc_object_container()->rooted_ = false;
                 });
             }
         }
@@ -1364,12 +2590,12 @@ class Member {
     friend class GcArray;
     template<class U>
     friend class Local;
+    // a member is just the pointer. the object containing it is not stored, so the barrier
+    // only knows the parent when the caller passes it in (see `assign`)
     GcPtr<T> ptr_;
-    GcObjectContainer *parent_;
-    Member(GcObjectContainer *parent, GcPtr<T> ptr) : ptr_(ptr), parent_(parent) {}
 
     // Dijkstra's write barrier
-    void update(GcPtr<T> ptr) {
+    void update(GcPtr<T> ptr, const GcObjectContainer *parent = nullptr) {
         if (ptr_ == ptr) [[unlikely]] {
             return;
         }
@@ -1378,10 +2604,17 @@ class Member {
             return;
         }
 
-        auto &heap = get_heap();
+        auto &heap = heap_of(this);
+        heap.record_store(this);
 
         if (heap.need_write_barrier()) [[likely]] {
-            if (parent_->color() == color::BLACK || heap.mode() == GcMode::CONCURRENT) {
+            if (!parent && heap.mode() == GcMode::INCREMENTAL) {
+                // an incremental heap only sweeps on the mutator, so the object around the member is stable here
+                parent = heap.object_containing(this);
+            }
+            // without a parent we can't tell whether it has been scanned already,
+            // so shade conservatively. this only costs some floating garbage
+            if (!parent || parent->color() == color::BLACK || heap.mode() == GcMode::CONCURRENT) {
                 if constexpr (is_debug) {
                     std::printf("write barrier, color=%d\n", ptr.gc_object_container()->color());
                 }
@@ -1393,7 +2626,9 @@ class Member {
     }
 public:
     template<is_traceable U>
-    explicit Member(U *parent) : ptr_(), parent_(parent) {}
+    explicit Member(U *parent) : ptr_() {
+        heap_of(this).note_member(this, parent);
+    }
     Member(Member &&) = delete;
     Member(const Member &) = delete;
     Member &operator=(std::nullptr_t) {
@@ -1411,6 +2646,11 @@ public:
         update(ptr);
         return *this;
     }
+    /// @brief store with the containing object known, lets the incremental barrier skip
+    /// shading when `parent` has not been scanned yet
+    void assign(const GcObjectContainer *parent, GcPtr<T> ptr) {
+        update(ptr, parent);
+    }
     T *operator->() const {
         return ptr_.operator->();
     }
@@ -1420,9 +2660,6 @@ public:
     const GcObjectContainer *gc_object_container() const {
         return ptr_.gc_object_container();
     }
-    const GcObjectContainer *parent() const {
-        return parent_;
-    }
     bool operator==(const GcPtr<T> &other) const {
         return ptr_ == other;
     }
@@ -1448,6 +2685,190 @@ struct apply_trace<Member<T>> {
         apply_trace<GcPtr<T>>{}(ctx, ptr.ptr_);
     }
 };
+static_assert(sizeof(Member<Traceable>) == sizeof(void *), "Member should be a single pointer");
+static_assert(std::is_trivially_destructible_v<Member<Traceable>>, "classes holding only Members and plain data may declare gc_trivially_destructible");
+namespace detail {
+/// @brief the slot handling shared by `Weak` and `Soft`
+template<class T, bool IsSoft>
+class WeakHandle {
+    static constexpr size_t no_slot = std::numeric_limits<size_t>::max();
+    size_t slot_ = no_slot;
+    void acquire(const GcObjectContainer *target) {
+        if (!target) {
+            return;
+        }
+        get_heap().weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            slot_ = refs.acquire(target, IsSoft);
+        });
+    }
+    void release() {
+        if (slot_ == no_slot) {
+            return;
+        }
+        get_heap().weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            refs.release(slot_);
+        });
+        slot_ = no_slot;
+    }
+public:
+    WeakHandle() = default;
+    WeakHandle(GcPtr<T> ptr) {
+        acquire(ptr.gc_object_container());
+    }
+    WeakHandle(const Local<T> &local) : WeakHandle(local.get()) {}
+    WeakHandle(const WeakHandle &other) {
+        acquire(other.lock().gc_object_container());
+    }
+    WeakHandle(WeakHandle &&other) noexcept : slot_(std::exchange(other.slot_, no_slot)) {}
+    WeakHandle &operator=(const WeakHandle &other) {
+        if (this != &other) {
+            release();
+            acquire(other.lock().gc_object_container());
+        }
+        return *this;
+    }
+    WeakHandle &operator=(WeakHandle &&other) noexcept {
+        if (this != &other) {
+            release();
+            slot_ = std::exchange(other.slot_, no_slot);
+        }
+        return *this;
+    }
+    ~WeakHandle() {
+        release();
+    }
+    /// @brief a rooted handle to the target, null once it has been collected
+    Local<T> lock() const {
+        if (slot_ == no_slot) {
+            return {};
+        }
+        // rooted while the lock is held, so the collector can't clear the slot between the read and the rooting
+        return get_heap().weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            auto target = refs.use(slot_);
+            return target ? Local<T>(GcPtr<T>(static_cast<T *>(const_cast<GcObjectContainer *>(target)))) : Local<T>();
+        });
+    }
+    bool expired() const {
+        if (slot_ == no_slot) {
+            return true;
+        }
+        return get_heap().weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            return refs.slots[slot_].target == nullptr;
+        });
+    }
+    void reset() {
+        release();
+    }
+};
+}// namespace detail
+/// @brief a reference that does not keep its target alive. The collector clears it once the target is found
+/// unreachable, `lock` turns it back into a `Local` while the target is still around.
+/// Can be held anywhere, including inside gc objects, but like `Local` it has to go before the heap does
+template<class T>
+using Weak = detail::WeakHandle<T, false>;
+/// @brief a reference that keeps its target alive as long as the heap is not under pressure, see
+/// `GcOption::soft_ref_threshold`. Meant for caches that can be rebuilt. `lock` counts as a use,
+/// the least recently used soft references are the first to go
+template<class T>
+using Soft = detail::WeakHandle<T, true>;
+/// @brief constructs a T that lives as long as the heap, in the `ImmortalSpace`. It is never swept, and a collection
+/// only traces it while it references objects that are not immortal themselves, so permanent data such as scene
+/// descriptions or configuration stops adding to the work of every cycle. Its containers keep their buffers there too
+template<class T, class... Args>
+    requires std::constructible_from<T, Args...>
+Local<T> make_immortal(Args &&...args) {
+    return GcPtr<T>{get_heap()._new_immortal_object<T>(std::forward<Args>(args)...)};
+}
+/// @brief makes an existing object live as long as the heap. It stays where it is and leaves its object list at the
+/// next sweep. Only the object itself is promoted, not what it references. Unlike objects from `make_immortal`, one
+/// holding references is still traced on every cycle, since the barrier can't see stores into it
+template<class T>
+void promote_to_immortal(GcPtr<T> ptr) {
+    heap_of(ptr.gc_object_container()).promote_to_immortal(ptr.gc_object_container());
+}
+template<class T>
+void promote_to_immortal(const Local<T> &ptr) {
+    promote_to_immortal(ptr.get());
+}
+namespace detail {
+template<class T>
+size_t image_type_id() {
+    return std::hash<std::string_view>{}(typeid(T).name());
+}
+}// namespace detail
+/// @brief writes `root` and everything reachable from it to the heap image `path`, so that a later run of the same
+/// binary can map the graph back with `load_image` instead of rebuilding it. Every object reached has to be
+/// `is_imageable`. Returns false when the file can not be written
+template<class T>
+bool save_image(GcPtr<T> root, const std::string &path) {
+    GC_ASSERT(root != nullptr, "Image root should not be null");
+    auto adjust = reinterpret_cast<const std::byte *>(root.get()) - reinterpret_cast<const std::byte *>(root.gc_object_container());
+    return heap_of(root.gc_object_container()).save_image(root.gc_object_container(), adjust, detail::image_type_id<T>(), path);
+}
+/// @brief maps a heap image written by `save_image` and returns its root, or null when the file is missing or was
+/// written for another root type or by another build. The pointers in the image are relocated in bulk and the mapping
+/// is then made read-only: its objects are immortal, never traced and may reference nothing outside of the image, so
+/// none of their members may be assigned. Pages holding no pointer stay shared with the page cache
+template<class T>
+Local<T> load_image(const std::string &path) {
+    return GcPtr<T>{static_cast<T *>(get_heap().load_image(path, detail::image_type_id<T>()))};
+}
+/// @brief keeps an object alive and at its address while the guard exists, so raw pointers into it can be
+/// handed to code the collector knows nothing about, like a `read` into a `GcBytes`.
+/// Rooted like a `Local`, and on top of that excluded from anything that moves objects
+template<class T>
+class Pin {
+    Local<T> ptr_;
+    void pin() const {
+        // objects in an image never move
+        if (auto obj = ptr_.gc_object_container(); obj && !obj->in_image()) {
+            obj->pin_count_.fetch_add(1, std::memory_order_acq_rel);
+        }
+    }
+    void unpin() const {
+        if (auto obj = ptr_.gc_object_container(); obj && !obj->in_image()) {
+            obj->pin_count_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+    }
+public:
+    Pin() = default;
+    Pin(GcPtr<T> ptr) : ptr_(ptr) {
+        pin();
+    }
+    Pin(const Local<T> &local) : Pin(local.get()) {}
+    Pin(const Pin &other) : Pin(other.get()) {}
+    Pin(Pin &&other) noexcept = default;
+    Pin &operator=(const Pin &other) {
+        if (this != &other) {
+            unpin();
+            ptr_ = other.ptr_;
+            pin();
+        }
+        return *this;
+    }
+    Pin &operator=(Pin &&other) noexcept {
+        if (this != &other) {
+            unpin();
+            ptr_ = std::move(other.ptr_);
+        }
+        return *this;
+    }
+    ~Pin() {
+        unpin();
+    }
+    T *operator->() const {
+        return ptr_.operator->();
+    }
+    T &operator*() const {
+        return *ptr_;
+    }
+    operator GcPtr<T>() const {
+        return ptr_;
+    }
+    GcPtr<T> get() const {
+        return ptr_.get();
+    }
+};
 
 /// @brief Fixed size array of gc objects
 template<class T>
@@ -1455,8 +2876,9 @@ class GcArray : public Traceable {
     Member<T> *data_;
     size_t size_;
 public:
+    static constexpr bool gc_trivially_relocatable = true;
     GcArray(size_t n) : data_(nullptr), size_(n) {
-        auto &heap = get_heap();
+        auto &heap = heap_of(this);
         auto alloc = std::pmr::polymorphic_allocator(heap.memory_resource(pool_idx()));
         data_ = alloc.template allocate_object<Member<T>>(n);
         for (size_t i = 0; i < n; i++) {
@@ -1469,6 +2891,9 @@ public:
     Member<T> &operator[](size_t idx) const {
         return data_[idx];
     }
+    void set(size_t idx, GcPtr<T> value) {
+        data_[idx].assign(this, value);
+    }
     size_t size() const {
         return size_;
     }
@@ -1480,6 +2905,9 @@ public:
             tracer(data_[i]);
         }
     }
+    void write_image(ImageWriter &writer) const override {
+        writer.buffer(data_, size_ * sizeof(Member<T>));
+    }
     size_t object_size() const override {
         return sizeof(*this);
     }
@@ -1487,7 +2915,7 @@ public:
         return alignof(GcArray<T>);
     }
     ~GcArray() {
-        auto &heap = get_heap();
+        auto &heap = heap_of(this);
         auto alloc = std::pmr::polymorphic_allocator(heap.memory_resource(pool_idx()));
         for (size_t i = 0; i < size_; i++) {
             data_[i].~Member<T>();
@@ -1495,79 +2923,108 @@ public:
         alloc.deallocate_object(data_, size_);
     }
 };
-template<class T>
+/// @brief Growable array of gc objects, stored in a single out-of-line buffer. With `N > 0` the first `N`
+/// elements live inline in the vector object itself, so small vectors are a single allocation, but every
+/// vector pays for the inline slots whether it uses them or not. The default keeps empty vectors small
+template<class T, size_t N = 0>
 class GcVector : public Traceable {
-    Member<GcArray<T>> data_;
-    size_t size_;
+    struct NoInlineStorage {};
+    [[no_unique_address]] alignas(Member<T>) std::conditional_t<N == 0, NoInlineStorage, std::array<std::byte, N * sizeof(Member<T>)>> inline_;
+    // null while the elements fit inline. never points into the object itself
+    Member<T> *spill_ = nullptr;
+    uint32_t capacity_ = N;
+    uint32_t size_ = 0;
 
-    Local<GcArray<T>> alloc(size_t len) {
-        return Local<GcArray<T>>::make_in_pool(pool_idx(), len);
+    Member<T> *data() const {
+        if constexpr (N == 0) {
+            return spill_;
+        } else {
+            if (spill_) {
+                return spill_;
+            }
+            return reinterpret_cast<Member<T> *>(const_cast<std::byte *>(inline_.data()));
+        }
+    }
+    std::pmr::memory_resource *resource() const {
+        return heap_of(this).memory_resource(pool_idx());
     }
     void ensure_size(size_t new_size) {
-        if (data_ == nullptr) {
-            data_ = alloc(std::max<size_t>(16, new_size));
+        if (new_size <= capacity_) {
             return;
         }
-        if (new_size <= data_->size()) {
-            return;
+        auto new_capacity = std::max<size_t>({8, capacity_ * 2ull, new_size});
+        GC_ASSERT(new_capacity <= std::numeric_limits<uint32_t>::max(), "GcVector too large");
+        auto alloc = std::pmr::polymorphic_allocator<Member<T>>(resource());
+        auto new_data = alloc.allocate(new_capacity);
+        auto old_data = data();
+        for (size_t i = 0; i < new_capacity; i++) {
+            new (new_data + i) Member<T>(this);
         }
-        auto new_capacity = std::max<size_t>(16ull, std::max(data_->size() * 2, new_size));
-        Local<GcArray<T>> new_data = alloc(new_capacity);
-        for (size_t i = 0; i < data_->size(); i++) {
-            (*new_data)[i] = (*data_)[i];
+        for (size_t i = 0; i < size_; i++) {
+            new_data[i].assign(this, old_data[i]);
+        }
+        auto old_spill = spill_;
+        auto old_capacity = capacity_;
+        spill_ = new_data;
+        capacity_ = static_cast<uint32_t>(new_capacity);
+        if (old_spill) {
+            heap_of(this).retire_buffer(resource(), old_spill, old_capacity * sizeof(Member<T>), alignof(Member<T>));
         }
-        data_ = new_data;
     }
 public:
-    struct Iter : public GarbageCollected<Iter> {
-        Member<GcVector<T>> vec_;
-        size_t idx_;
-        Iter(GcPtr<GcVector<T>> vec, size_t idx) : vec_(this), idx_(idx) {
-            vec_ = vec;
-        }
-        GC_CLASS(vec_)
-        Member<T> &operator*() {
-            return (*vec_)[idx_];
-        }
-        Iter &operator++() {
-            idx_++;
-            return *this;
-        }
-
-        Iter operator++(int) {
-            Iter temp(vec_, idx_);
-            idx_++;
-            return temp;
-        }
-        bool operator!=(const Iter &other) const {
-            return idx_ != other.idx_;
-        }
-        bool operator==(const Iter &other) const {
-            return idx_ == other.idx_;
+    static constexpr bool gc_trivially_relocatable = true;
+    /// plain pointers into the element storage. no barrier and no rooting, the vector has to be kept alive
+    /// by the caller and must not grow while iterating. use `view()` when nothing else roots the vector, with
+    /// `GcOption::compaction` an unrooted vector may move along with its inline elements
+    using iterator = Member<T> *;
+    iterator begin() const {
+        return data();
+    }
+    iterator end() const {
+        return data() + size_;
+    }
+    /// @brief a contiguous range over the elements that keeps the vector rooted while the view is alive
+    class View : public std::ranges::view_interface<View> {
+        Local<GcVector> owner_;
+    public:
+        View() = default;
+        explicit View(GcPtr<GcVector> owner) : owner_(owner) {}
+        iterator begin() const {
+            return owner_->begin();
+        }
+        iterator end() const {
+            return owner_->end();
         }
     };
-    Iter begin() {
-        return Iter(gc_ptr_from_this(), 0);
-    }
-    Iter end() {
-        return Iter(gc_ptr_from_this(), size_);
+    View view() {
+        return View(gc_ptr_from_this());
     }
     size_t capacity() const {
-        return data_->size();
+        return capacity_;
+    }
+    GcVector() {
+        for (size_t i = 0; i < N; i++) {
+            new (data() + i) Member<T>(this);
+        }
     }
-    GcVector() : data_(this), size_(0) {}
     void push_back(GcPtr<T> value) {
         ensure_size(size_ + 1);
-        (*data_)[size_++] = value;
+        data()[size_].assign(this, value);
+        // publish the (possibly new) buffer before the size, see `trace`
+        std::atomic_thread_fence(std::memory_order_release);
+        size_++;
     }
     Member<T> &operator[](size_t idx) {
-        return (*data_)[idx];
+        return data()[idx];
+    }
+    void set(size_t idx, GcPtr<T> value) {
+        data()[idx].assign(this, value);
     }
     Member<T> &at(size_t idx) const {
         if (idx >= size_) {
             throw std::out_of_range("Index out of range");
         }
-        return (*data_)[idx];
+        return data()[idx];
     }
     void pop_back() {
         at(size_ - 1) = nullptr;
@@ -1575,150 +3032,843 @@ public:
     }
     Member<T> &back() {
         GC_ASSERT(size_ > 0, "Size should be greater than 0");
-        return (*data_)[size_ - 1];
+        return data()[size_ - 1];
+    }
+    size_t size() const {
+        return size_;
+    }
+    void trace(const Tracer &tracer) const override {
+        // the concurrent collector can race with `push_back`. reading the size first guarantees the buffer
+        // we read afterwards is at least that large, and old buffers are kept alive by `retire_buffer`
+        auto size = size_;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto elements = data();
+        for (size_t i = 0; i < size; i++) {
+            tracer(elements[i]);
+        }
+    }
+    void write_image(ImageWriter &writer) const override {
+        writer.buffer(spill_, spill_ ? capacity_ * sizeof(Member<T>) : 0);
+    }
+    size_t object_size() const override {
+        return sizeof(*this);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcVector);
+    }
+    auto gc_ptr_from_this() {
+        return GcPtr<GcVector>(this);
+    }
+    ~GcVector() {
+        if (spill_) {
+            auto alloc = std::pmr::polymorphic_allocator<Member<T>>(resource());
+            alloc.deallocate(spill_, capacity_);
+        }
+    }
+};
+/// @brief Growable array of plain values, stored unboxed in a single gc object.
+/// The object is pointer-free: the collector blackens it on sight and never scans the elements.
+/// The first `N` elements live inline, larger arrays spill to an out-of-line buffer
+template<class T, size_t N = 4>
+    requires std::is_trivially_copyable_v<T>
+class GcPodArray : public GcObjectContainer {
+    static_assert(N > 0, "inline capacity should be positive");
+    alignas(T) std::byte inline_[N * sizeof(T)];
+    // null while the elements fit inline
+    T *spill_ = nullptr;
+    uint32_t capacity_ = N;
+    uint32_t size_ = 0;
+
+    std::pmr::memory_resource *resource() const {
+        return heap_of(this).memory_resource(pool_idx());
+    }
+    void grow(size_t new_capacity) {
+        GC_ASSERT(new_capacity <= std::numeric_limits<uint32_t>::max(), "GcPodArray too large");
+        auto alloc = std::pmr::polymorphic_allocator<T>(resource());
+        auto new_data = alloc.allocate(new_capacity);
+        std::memcpy(new_data, data(), size_ * sizeof(T));
+        // the collector never reads the elements, so unlike `GcVector` the old buffer can go right away
+        if (spill_) {
+            alloc.deallocate(spill_, capacity_);
+        }
+        spill_ = new_data;
+        capacity_ = static_cast<uint32_t>(new_capacity);
+    }
+public:
+    static constexpr bool gc_imageable = true;
+    GcPodArray() = default;
+    explicit GcPodArray(size_t size, const T &value = T{}) {
+        resize(size, value);
+    }
+    T *data() {
+        return spill_ ? spill_ : reinterpret_cast<T *>(inline_);
+    }
+    const T *data() const {
+        return spill_ ? spill_ : reinterpret_cast<const T *>(inline_);
+    }
+    std::span<T> span() {
+        return {data(), size_};
+    }
+    std::span<const T> span() const {
+        return {data(), size_};
+    }
+    T *begin() {
+        return data();
+    }
+    T *end() {
+        return data() + size_;
+    }
+    const T *begin() const {
+        return data();
+    }
+    const T *end() const {
+        return data() + size_;
+    }
+    void reserve(size_t new_capacity) {
+        if (new_capacity > capacity_) {
+            grow(new_capacity);
+        }
+    }
+    void resize(size_t new_size, const T &value = T{}) {
+        reserve(new_size);
+        if (new_size > size_) {
+            std::uninitialized_fill(data() + size_, data() + new_size, value);
+        }
+        size_ = static_cast<uint32_t>(new_size);
+    }
+    void push_back(const T &value) {
+        if (size_ == capacity_) {
+            grow(std::max<size_t>({8, capacity_ * 2ull}));
+        }
+        data()[size_++] = value;
+    }
+    void pop_back() {
+        GC_ASSERT(size_ > 0, "Size should be greater than 0");
+        size_--;
+    }
+    void clear() {
+        size_ = 0;
+    }
+    T &operator[](size_t idx) {
+        return data()[idx];
+    }
+    const T &operator[](size_t idx) const {
+        return data()[idx];
+    }
+    T &at(size_t idx) {
+        if (idx >= size_) {
+            throw std::out_of_range("Index out of range");
+        }
+        return data()[idx];
+    }
+    T &back() {
+        GC_ASSERT(size_ > 0, "Size should be greater than 0");
+        return data()[size_ - 1];
     }
     size_t size() const {
         return size_;
     }
-    GC_CLASS(data_)
+    bool empty() const {
+        return size_ == 0;
+    }
+    size_t capacity() const {
+        return capacity_;
+    }
+    void write_image(ImageWriter &writer) const override {
+        writer.buffer(spill_, spill_ ? capacity_ * sizeof(T) : 0);
+    }
+    size_t object_size() const override {
+        return sizeof(*this);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcPodArray);
+    }
+    auto gc_ptr_from_this() {
+        return GcPtr<GcPodArray>(this);
+    }
+    ~GcPodArray() {
+        if (spill_) {
+            auto alloc = std::pmr::polymorphic_allocator<T>(resource());
+            alloc.deallocate(spill_, capacity_);
+        }
+    }
+};
+/// @brief Immutable string whose bytes live right behind the object, in the same gc allocation,
+/// so they are accounted in the heap size. Pointer-free, and the hash is computed once at creation
+class GcString : public GcObjectContainer {
+    friend class GcHeap;
+public:
+    static constexpr bool gc_trivially_destructible = true;
+    static constexpr bool gc_trivially_relocatable = true;
+private:
+    size_t hash_;
+    uint32_t size_;
+
+    explicit GcString(std::string_view s) : hash_(std::hash<std::string_view>{}(s)), size_(static_cast<uint32_t>(s.size())) {
+        std::memcpy(chars(), s.data(), s.size());
+        chars()[s.size()] = '\0';
+    }
+    char *chars() {
+        return reinterpret_cast<char *>(this + 1);
+    }
+    static size_t allocation_size(size_t n) {
+        return sizeof(GcString) + n + 1;
+    }
+public:
+    static Local<GcString> make(std::string_view s) {
+        GC_ASSERT(s.size() <= std::numeric_limits<uint32_t>::max(), "GcString too large");
+        return GcPtr<GcString>{get_heap()._new_object_sized<GcString>(std::nullopt, allocation_size(s.size()), s)};
+    }
+    const char *data() const {
+        return reinterpret_cast<const char *>(this + 1);
+    }
+    const char *c_str() const {
+        return data();
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    size_t hash() const {
+        return hash_;
+    }
+    std::string_view view() const {
+        return {data(), size_};
+    }
+    operator std::string_view() const {
+        return view();
+    }
+    bool operator==(const GcString &other) const {
+        if (this == &other) {
+            return true;
+        }
+        return hash_ == other.hash_ && size_ == other.size_ && std::memcmp(data(), other.data(), size_) == 0;
+    }
+    bool operator==(std::string_view other) const {
+        return view() == other;
+    }
+    auto operator<=>(const GcString &other) const {
+        return view() <=> other.view();
+    }
+    friend std::ostream &operator<<(std::ostream &os, const GcString &s) {
+        return os << s.view();
+    }
+    size_t object_size() const override {
+        return allocation_size(size_);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcString);
+    }
+};
+/// @brief Fixed size, mutable byte buffer whose storage lives right behind the object like that of `GcString`.
+/// It is never relocated, so while a `Pin` holds it `data()` can be passed straight to `read`, `recv` or
+/// `writev` without staging the bytes in memory of its own
+class GcBytes : public GcObjectContainer {
+    friend class GcHeap;
+public:
+    static constexpr bool gc_trivially_destructible = true;
+    static constexpr bool gc_imageable = true;
+private:
+    size_t size_;
+
+    struct for_overwrite_t {};
+    GcBytes(size_t size, for_overwrite_t) : size_(size) {}
+    explicit GcBytes(size_t size) : size_(size) {
+        std::memset(data(), 0, size);
+    }
+    explicit GcBytes(std::span<const std::byte> bytes) : size_(bytes.size()) {
+        std::memcpy(data(), bytes.data(), bytes.size());
+    }
+    static size_t allocation_size(size_t n) {
+        return sizeof(GcBytes) + n;
+    }
+public:
+    /// zero-filled
+    static Local<GcBytes> make(size_t size) {
+        return GcPtr<GcBytes>{get_heap()._new_object_sized<GcBytes>(std::nullopt, allocation_size(size), size)};
+    }
+    static Local<GcBytes> make(std::span<const std::byte> bytes) {
+        return GcPtr<GcBytes>{get_heap()._new_object_sized<GcBytes>(std::nullopt, allocation_size(bytes.size()), bytes)};
+    }
+    /// left uninitialized, for buffers that are filled right away
+    static Local<GcBytes> make_for_overwrite(size_t size) {
+        return GcPtr<GcBytes>{get_heap()._new_object_sized<GcBytes>(std::nullopt, allocation_size(size), size, for_overwrite_t{})};
+    }
+    std::byte *data() {
+        return reinterpret_cast<std::byte *>(this + 1);
+    }
+    const std::byte *data() const {
+        return reinterpret_cast<const std::byte *>(this + 1);
+    }
+    size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    std::span<std::byte> bytes() {
+        return {data(), size_};
+    }
+    std::span<const std::byte> bytes() const {
+        return {data(), size_};
+    }
+    size_t object_size() const override {
+        return allocation_size(size_);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcBytes);
+    }
+};
+namespace detail {
+/// @brief 16 control bytes of an open addressing table, matched all at once
+struct ControlGroup {
+    static constexpr size_t width = 16;
+    static constexpr int8_t empty = -128;// 0b10000000
+    static constexpr int8_t deleted = -2;// 0b11111110
+#if defined(__x86_64__) || defined(_M_X64) || defined(_WIN64)
+    __m128i ctrl;
+    explicit ControlGroup(const int8_t *p) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) {}
+    uint32_t match(int8_t h2) const {
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl)));
+    }
+    uint32_t match_empty_or_deleted() const {
+        // full slots are the only ones with the sign bit cleared
+        return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+    }
+#else
+    int8_t ctrl[width];
+    explicit ControlGroup(const int8_t *p) {
+        std::memcpy(ctrl, p, width);
+    }
+    uint32_t match(int8_t h2) const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < width; i++) {
+            mask |= static_cast<uint32_t>(ctrl[i] == h2) << i;
+        }
+        return mask;
+    }
+    uint32_t match_empty_or_deleted() const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < width; i++) {
+            mask |= static_cast<uint32_t>(ctrl[i] < 0) << i;
+        }
+        return mask;
+    }
+#endif
+    uint32_t match_empty() const {
+        return match(empty);
+    }
 };
+inline size_t mix_hash(size_t h) {
+    // std::hash is the identity for integers, spread the bits before splitting into h1/h2
+    h *= 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 32);
+}
+}// namespace detail
+/// @brief Swiss table style hash map. Control bytes and slots share a single buffer,
+/// keys and values are stored inline in the slots and traced from there.
+/// Growing is incremental: the old table stays around next to the new one and every insert
+/// migrates a few groups, so no single insert has to move the whole map
 template<class K, class V>
 class GcHashMap : public GarbageCollected<GcHashMap<K, V>> {
-    struct Bucket : public Traceable {
+    using Group = detail::ControlGroup;
+    struct Slot {
         Member<K> key;
         Member<V> value;
-        Member<Bucket> next;
-        GC_CLASS(key, value, next)
-        Bucket() : key(this), value(this), next(this) {}
     };
-    Member<GcArray<Bucket>> data_;
+    /// followed by `capacity` control bytes and then `capacity` slots
+    struct Table {
+        size_t capacity;
+        size_t growth_left;
+        int8_t *ctrl() {
+            return reinterpret_cast<int8_t *>(this + 1);
+        }
+        Slot *slots() {
+            return reinterpret_cast<Slot *>(ctrl() + capacity);
+        }
+        static size_t alloc_size(size_t capacity) {
+            return sizeof(Table) + capacity + capacity * sizeof(Slot);
+        }
+    };
+    static_assert(sizeof(Table) % alignof(Slot) == 0 && Group::width % alignof(Slot) == 0);
+    static constexpr size_t groups_migrated_per_insert = 2;
+    // null until the first insert. the table carries its own capacity so that the
+    // concurrent collector gets a consistent view from a single read
+    Table *table_ = nullptr;
+    // the previous table while it is being migrated into `table_`, otherwise null
+    Table *old_table_ = nullptr;
+    size_t migrate_pos_ = 0;
     size_t total_size_ = 0;
-    double load_factor() const {
-        return static_cast<double>(total_size_) / data_->size();
+    size_t initial_capacity_;
+
+    std::pmr::memory_resource *resource() const {
+        return heap_of(this).memory_resource(this->pool_idx());
     }
-    void rehash() {
-        auto new_hashmap = Local<GcHashMap<K, V>>::make(data_->size() * 2);
-        for (auto [k, v] : *this) {
-            new_hashmap->insert(k, v);
+    static size_t hash(GcPtr<K> key) {
+        return detail::mix_hash(std::hash<K>{}(*key.get()));
+    }
+    static int8_t h2(size_t hash) {
+        return static_cast<int8_t>(hash & 0x7f);
+    }
+    static bool key_equal(GcPtr<K> a, GcPtr<K> b) {
+        if (a == b) {
+            return true;
+        }
+        if constexpr (std::equality_comparable<K>) {
+            return *a == *b;
+        } else {
+            return false;
+        }
+    }
+    Table *allocate_table(size_t capacity) {
+        auto alloc = std::pmr::polymorphic_allocator<>(resource());
+        auto table = static_cast<Table *>(alloc.allocate_bytes(Table::alloc_size(capacity), alignof(Table)));
+        table->capacity = capacity;
+        table->growth_left = capacity - capacity / 8;
+        // slots are only constructed when they get filled, so this is the only O(capacity) work
+        std::memset(table->ctrl(), Group::empty, capacity);
+        return table;
+    }
+    void free_table(Table *table, bool retire) {
+        auto bytes = Table::alloc_size(table->capacity);
+        if (retire) {
+            heap_of(this).retire_buffer(resource(), table, bytes, alignof(Table));
+        } else {
+            std::pmr::polymorphic_allocator<>(resource()).deallocate_bytes(table, bytes, alignof(Table));
+        }
+    }
+    /// @brief calls `f(group_start)` along the probe sequence of `hash` until it returns true
+    template<class F>
+    static void probe(Table *table, size_t hash, F &&f) {
+        auto group_mask = table->capacity / Group::width - 1;
+        auto group = (hash >> 7) & group_mask;
+        // triangular probing visits every group when the group count is a power of two
+        for (size_t step = 1;; step++) {
+            if (f(group * Group::width)) {
+                return;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+    std::optional<size_t> find(Table *table, GcPtr<K> key, size_t hash) const {
+        if (!table) {
+            return std::nullopt;
+        }
+        std::optional<size_t> result;
+        probe(table, hash, [&](size_t start) {
+            auto group = Group(table->ctrl() + start);
+            for (auto mask = group.match(h2(hash)); mask; mask &= mask - 1) {
+                auto idx = start + std::countr_zero(mask);
+                if (key_equal(table->slots()[idx].key, key)) {
+                    result = idx;
+                    return true;
+                }
+            }
+            return group.match_empty() != 0;
+        });
+        return result;
+    }
+    Slot *lookup(GcPtr<K> key, size_t hash) const {
+        for (auto table : {table_, old_table_}) {
+            if (auto idx = find(table, key, hash)) {
+                return &table->slots()[*idx];
+            }
+        }
+        return nullptr;
+    }
+    /// @brief puts a key known to be absent into `table`, which must have room for it
+    void insert_new(Table *table, GcPtr<K> key, GcPtr<V> value, size_t hash) {
+        probe(table, hash, [&](size_t start) {
+            auto mask = Group(table->ctrl() + start).match_empty_or_deleted();
+            if (!mask) {
+                return false;
+            }
+            auto idx = start + std::countr_zero(mask);
+            if (table->ctrl()[idx] == Group::empty) {
+                table->growth_left--;
+            }
+            auto &slot = *new (&table->slots()[idx]) Slot{Member<K>(this), Member<V>(this)};
+            slot.key.assign(this, key);
+            slot.value.assign(this, value);
+            // the slot has to be filled before the collector can see it as full
+            std::atomic_thread_fence(std::memory_order_release);
+            table->ctrl()[idx] = h2(hash);
+            return true;
+        });
+    }
+    void start_rehash() {
+        GC_ASSERT(old_table_ == nullptr, "Previous rehash should have finished");
+        old_table_ = table_;
+        migrate_pos_ = 0;
+        table_ = allocate_table(table_->capacity * 2);
+    }
+    /// @brief moves up to `n_groups` groups of the old table into the new one
+    void migrate(size_t n_groups) {
+        if (!old_table_) {
+            return;
+        }
+        auto end = migrate_pos_ + std::min(n_groups * Group::width, old_table_->capacity - migrate_pos_);
+        for (; migrate_pos_ < end; migrate_pos_++) {
+            auto &ctrl = old_table_->ctrl()[migrate_pos_];
+            if (ctrl < 0) {
+                continue;
+            }
+            auto &slot = old_table_->slots()[migrate_pos_];
+            insert_new(table_, slot.key, slot.value, hash(slot.key));
+            // keep probing past it for the entries that are not migrated yet
+            ctrl = Group::deleted;
+        }
+        if (migrate_pos_ == old_table_->capacity) {
+            free_table(old_table_, true);
+            old_table_ = nullptr;
         }
-        data_ = new_hashmap->data_;
     }
 public:
+    static constexpr bool gc_imageable = true;
     size_t size() const {
         return total_size_;
     }
-    struct Iter : public GarbageCollected<Iter> {
-        Member<GcHashMap<K, V>> map_;
-        size_t idx_;
-        Member<Bucket> current_;
-        GC_CLASS(map_, current_)
-        Iter(GcPtr<GcHashMap<K, V>> map, size_t idx, GcPtr<Bucket> current) : map_(this), idx_(idx), current_(this) {
-            map_ = map;
-            current_ = current;
-        }
-        std::pair<GcPtr<K>, GcPtr<V>> operator*() {
-            GC_ASSERT(current_, "Invalid iterator");
-            return {current_->key, current_->value};
-        }
-        void advance() {
-            if (current_ == nullptr) {
-                return;
-            }
-            if (current_->next) {
-                current_ = current_->next;
-                return;
+    /// @brief iterates the new table first, then whatever has not been migrated out of the old one.
+    /// a plain forward iterator holding a raw pointer to the map, so the map has to be kept alive by
+    /// the caller and must not be inserted into while iterating. use `view()` when nothing else roots the map
+    class Iter {
+        const GcHashMap *map_ = nullptr;
+        size_t idx_ = 0;
+        std::pair<Table *, size_t> locate() const {
+            auto table = map_->table_;
+            if (table && idx_ >= table->capacity) {
+                return {map_->old_table_, idx_ - table->capacity};
             }
-            for (size_t i = idx_ + 1; i < map_->data_->size(); i++) {
-                if ((*map_->data_)[i]) {
-                    idx_ = i;
-                    current_ = (*map_->data_)[i];
+            return {table, idx_};
+        }
+        void skip_empty() {
+            while (true) {
+                auto [table, idx] = locate();
+                if (!table || idx >= table->capacity || table->ctrl()[idx] >= 0) {
                     return;
                 }
+                idx_++;
             }
-            current_ = nullptr;
         }
-        bool operator!=(const Iter &other) const {
-            return current_ != other.current_;
+    public:
+        using value_type = std::pair<GcPtr<K>, GcPtr<V>>;
+        using difference_type = std::ptrdiff_t;
+        using iterator_concept = std::forward_iterator_tag;
+        Iter() = default;
+        Iter(const GcHashMap *map, size_t idx) : map_(map), idx_(idx) {
+            skip_empty();
+        }
+        value_type operator*() const {
+            auto [table, idx] = locate();
+            auto &slot = table->slots()[idx];
+            return {slot.key, slot.value};
         }
         Iter &operator++() {
-            advance();
+            idx_++;
+            skip_empty();
             return *this;
         }
         Iter operator++(int) {
-            Iter temp = *this;
-            advance();
+            auto temp = *this;
+            ++*this;
             return temp;
         }
-    };
-    Iter begin() {
-        for (size_t i = 0; i < data_->size(); i++) {
-            if ((*data_)[i]) {
-                return Iter(gc_ptr_from_this(), i, (*data_)[i]);
-            }
+        bool operator==(const Iter &other) const {
+            return idx_ == other.idx_;
         }
-        return end();
+    };
+    using iterator = Iter;
+    Iter begin() const {
+        return Iter(this, 0);
     }
-    Iter end() {
-        return Iter(gc_ptr_from_this(), std::numeric_limits<size_t>::max(), GcPtr<Bucket>(nullptr));
+    Iter end() const {
+        auto n = table_ ? table_->capacity : 0;
+        if (old_table_) {
+            n += old_table_->capacity;
+        }
+        return Iter(this, n);
     }
-    GcHashMap(size_t hash_size = 64) : data_(this) {
-        data_ = Local<GcArray<Bucket>>::make(hash_size);
+    /// @brief a forward range over the entries that keeps the map rooted while the view is alive
+    class View : public std::ranges::view_interface<View> {
+        Local<GcHashMap> owner_;
+    public:
+        View() = default;
+        explicit View(GcPtr<GcHashMap> owner) : owner_(owner) {}
+        Iter begin() const {
+            return owner_->begin();
+        }
+        Iter end() const {
+            return owner_->end();
+        }
+    };
+    View view() {
+        return View(gc_ptr_from_this());
     }
+    explicit GcHashMap(size_t hash_size = Group::width) : initial_capacity_(std::bit_ceil(std::max(hash_size, Group::width))) {}
     void insert(std::pair<gc::GcPtr<K>, gc::GcPtr<V>> pair) {
         insert(pair.first, pair.second);
     }
     void insert(gc::GcPtr<K> key, gc::GcPtr<V> value) {
-        auto idx = bucket_index(key);
-        Member<Bucket> &bucket = (*data_)[idx];
-        GcPtr<Bucket> current = bucket;
-        while (current) {
-            if (current->key == key) {
-                current->value = value;
+        auto h = hash(key);
+        if (auto slot = lookup(key, h)) {
+            slot->value.assign(this, value);
+            return;
+        }
+        if (!table_) {
+            table_ = allocate_table(initial_capacity_);
+        } else if (table_->growth_left == 0) {
+            // the new table is twice as large, so migration normally finishes long before it fills up
+            migrate(std::numeric_limits<size_t>::max() / Group::width);
+            start_rehash();
+        }
+        migrate(groups_migrated_per_insert);
+        insert_new(table_, key, value, h);
+        total_size_++;
+    }
+    /// lookups only probe, they never migrate, so they are safe to call while iterating
+    bool contains(gc::GcPtr<K> key) const {
+        return lookup(key, hash(key)) != nullptr;
+    }
+    gc::GcPtr<V> at(gc::GcPtr<K> key) const {
+        auto slot = lookup(key, hash(key));
+        GC_ASSERT(slot != nullptr, "Key not found");
+        return slot->value;
+    }
+    void trace(const Tracer &tracer) const override {
+        for (auto table : {table_, old_table_}) {
+            if (!table) {
+                continue;
+            }
+            for (size_t i = 0; i < table->capacity; i++) {
+                if (table->ctrl()[i] >= 0) {
+                    auto &slot = table->slots()[i];
+                    tracer(slot.key, slot.value);
+                }
+            }
+        }
+    }
+    void write_image(ImageWriter &writer) const override {
+        for (auto table : {&table_, &old_table_}) {
+            writer.buffer(*table, *table ? Table::alloc_size((*table)->capacity) : 0);
+        }
+    }
+    size_t object_size() const override {
+        return sizeof(*this);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcHashMap);
+    }
+    auto gc_ptr_from_this() {
+        return GcPtr<GcHashMap>(this);
+    }
+    ~GcHashMap() {
+        for (auto table : {table_, old_table_}) {
+            if (table) {
+                free_table(table, false);
+            }
+        }
+    }
+};
+/// @brief Hash map whose entries are ephemerons: an entry keeps its value alive only while the key is reachable
+/// from elsewhere, and the entry disappears once the key is collected. Keys compare like in `GcHashMap`.
+/// The entries are not traced with the map, the heap processes them after marking under the weak reference
+/// lock, which every operation takes as well. A linear probing table, removed entries leave tombstones behind
+template<class K, class V>
+class GcWeakHashMap : public GarbageCollected<GcWeakHashMap<K, V>> {
+    using Entry = EphemeronTable::Entry;
+    static constexpr size_t min_capacity = 16;
+    EphemeronTable table_;
+    std::pmr::memory_resource *resource() const {
+        return heap_of(this).memory_resource(this->pool_idx());
+    }
+    template<class F>
+    static decltype(auto) locked(F &&f) {
+        return get_heap().weak_refs().with([&](WeakRefs &, auto *lock) -> decltype(auto) { return f(); });
+    }
+    template<class U>
+    static GcPtr<U> as_ptr(const GcObjectContainer *ptr) {
+        return GcPtr<U>(static_cast<U *>(const_cast<GcObjectContainer *>(ptr)));
+    }
+    static size_t hash(GcPtr<K> key) {
+        return detail::mix_hash(std::hash<K>{}(*key.get()));
+    }
+    static bool key_equal(const Entry &entry, GcPtr<K> key, size_t hash) {
+        if (entry.key == key.gc_object_container()) {
+            return true;
+        }
+        if constexpr (std::equality_comparable<K>) {
+            return entry.hash == hash && *as_ptr<K>(entry.key) == *key;
+        } else {
+            return false;
+        }
+    }
+    Entry *find(GcPtr<K> key, size_t hash) const {
+        if (table_.capacity == 0) {
+            return nullptr;
+        }
+        auto mask = table_.capacity - 1;
+        for (auto i = hash & mask;; i = (i + 1) & mask) {
+            auto &entry = table_.entries[i];
+            if (entry.state == EphemeronTable::EMPTY) {
+                return nullptr;
+            }
+            if (entry.state == EphemeronTable::FULL && key_equal(entry, key, hash)) {
+                return &entry;
+            }
+        }
+    }
+    bool has_room() const {
+        return (table_.used + 1) * 4 <= table_.capacity * 3;
+    }
+    void insert_new(const GcObjectContainer *key, const GcObjectContainer *value, size_t hash) {
+        auto mask = table_.capacity - 1;
+        for (auto i = hash & mask;; i = (i + 1) & mask) {
+            auto &entry = table_.entries[i];
+            if (entry.state != EphemeronTable::FULL) {
+                if (entry.state == EphemeronTable::EMPTY) {
+                    table_.used++;
+                }
+                entry = Entry{key, value, hash, EphemeronTable::FULL};
+                table_.size++;
                 return;
             }
-            current = current->next;
         }
-        auto new_bucket = Local<Bucket>::make();
-        new_bucket->key = key;
-        new_bucket->value = value;
-        new_bucket->next = bucket;
-        bucket = new_bucket;
-        total_size_++;
-        if (load_factor() > 0.75) {
-            rehash();
+    }
+    void free_entries(Entry *entries, size_t capacity) {
+        if (entries) {
+            std::pmr::polymorphic_allocator<Entry>(resource()).deallocate(entries, capacity);
         }
     }
-    bool contains(gc::GcPtr<K> key) {
-        auto idx = bucket_index(key);
-        Member<Bucket> &bucket = (*data_)[idx];
-        GcPtr<Bucket> current = bucket;
-        while (current) {
-            if (current->key == key) {
+    /// @brief moves the entries into a table with room for at least one more, dropping the tombstones
+    void grow() {
+        auto capacity = locked([&] { return std::max(min_capacity, std::bit_ceil((table_.size + 1) * 2)); });
+        // allocating may run a collection, which processes this table, so the lock can't be held here
+        auto entries = std::pmr::polymorphic_allocator<Entry>(resource()).allocate(capacity);
+        std::uninitialized_fill_n(entries, capacity, Entry{nullptr, nullptr, 0, EphemeronTable::EMPTY});
+        auto [old_entries, old_capacity] = locked([&]() -> std::pair<Entry *, size_t> {
+            if ((table_.size + 1) * 4 > capacity * 3) {
+                // the table grew by more than that in the meantime
+                return {entries, capacity};
+            }
+            auto old = std::pair{table_.entries, table_.capacity};
+            table_.entries = entries;
+            table_.capacity = capacity;
+            table_.size = 0;
+            table_.used = 0;
+            for (size_t i = 0; i < old.second; i++) {
+                auto &entry = old.first[i];
+                if (entry.state == EphemeronTable::FULL) {
+                    insert_new(entry.key, entry.value, entry.hash);
+                }
+            }
+            return old;
+        });
+        free_entries(old_entries, old_capacity);
+    }
+public:
+    GcWeakHashMap() {
+        table_.owner = this;
+        heap_of(this).weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            refs.add_table(&table_);
+        });
+    }
+    GcWeakHashMap(const GcWeakHashMap &) = delete;
+    GcWeakHashMap &operator=(const GcWeakHashMap &) = delete;
+    /// entries whose key has been collected are gone already, so this only counts live keys
+    size_t size() const {
+        return locked([&] { return table_.size; });
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    void insert(GcPtr<K> key, GcPtr<V> value) {
+        GC_ASSERT(key != nullptr, "Key should not be null");
+        auto h = hash(key);
+        for (;;) {
+            auto inserted = locked([&] {
+                if (auto entry = find(key, h)) {
+                    entry->value = value.gc_object_container();
+                    return true;
+                }
+                if (!has_room()) {
+                    return false;
+                }
+                insert_new(key.gc_object_container(), value.gc_object_container(), h);
                 return true;
+            });
+            if (inserted) {
+                return;
             }
-            current = current->next;
+            grow();
         }
-        return false;
     }
-    gc::GcPtr<V> at(gc::GcPtr<K> key) {
-        auto idx = bucket_index(key);
-        auto &bucket = (*data_)[idx];
-        auto current = bucket;
-        while (current) {
-            if (current->key == key) {
-                return current->value;
+    bool contains(GcPtr<K> key) const {
+        auto h = hash(key);
+        return locked([&] { return find(key, h) != nullptr; });
+    }
+    /// @brief the value for `key`, null when there is none
+    GcPtr<V> get(GcPtr<K> key) const {
+        auto h = hash(key);
+        return locked([&] {
+            auto entry = find(key, h);
+            return entry ? as_ptr<V>(entry->value) : GcPtr<V>();
+        });
+    }
+    GcPtr<V> at(GcPtr<K> key) const {
+        auto h = hash(key);
+        return locked([&] {
+            auto entry = find(key, h);
+            GC_ASSERT(entry != nullptr, "Key not found");
+            return as_ptr<V>(entry->value);
+        });
+    }
+    bool erase(GcPtr<K> key) {
+        auto h = hash(key);
+        return locked([&] {
+            auto entry = find(key, h);
+            if (!entry) {
+                return false;
             }
-            current = current->next;
-        }
-        GC_ASSERT(false, "Key not found");
+            table_.remove(*entry);
+            return true;
+        });
     }
-    GC_CLASS(data_)
-private:
-    size_t bucket_index(gc::GcPtr<K> key) {
-        return std::hash<K>{}(*key.get()) % data_->size();
+    /// @brief calls `f(key, value)` for every entry with the weak reference lock held,
+    /// so `f` must not allocate in concurrent mode
+    template<class F>
+        requires std::invocable<F, GcPtr<K>, GcPtr<V>>
+    void for_each(F &&f) const {
+        locked([&] {
+            for (size_t i = 0; i < table_.capacity; i++) {
+                auto &entry = table_.entries[i];
+                if (entry.state == EphemeronTable::FULL) {
+                    f(as_ptr<K>(entry.key), as_ptr<V>(entry.value));
+                }
+            }
+        });
+    }
+    // the entries are ephemerons, the heap takes care of them after marking
+    void trace(const Tracer &tracer) const override {}
+    size_t object_size() const override {
+        return sizeof(*this);
+    }
+    size_t object_alignment() const override {
+        return alignof(GcWeakHashMap);
+    }
+    auto gc_ptr_from_this() {
+        return GcPtr<GcWeakHashMap>(this);
+    }
+    ~GcWeakHashMap() {
+        heap_of(this).weak_refs().with([&](WeakRefs &refs, auto *lock) {
+            refs.remove_table(&table_);
+        });
+        free_entries(table_.entries, table_.capacity);
     }
 };
 }// namespace gc
+/// address based, with `GcOption::compaction` only stable for objects that are rooted or not relocatable
 template<class T>
 struct std::hash<gc::GcPtr<T>> {
     size_t operator()(const gc::GcPtr<T> &ptr) const {
@@ -1730,4 +3880,10 @@ struct std::hash<gc::Adaptor<T>> {
     size_t operator()(const gc::Adaptor<T> &obj) const {
         return std::hash<T>{}(obj);
     }
+};
+template<>
+struct std::hash<gc::GcString> {
+    size_t operator()(const gc::GcString &s) const {
+        return s.hash();
+    }
 };
\ No newline at end of file
@@ -3,7 +3,10 @@
 #include "rc.h"
 #include <array>
 #include <numeric>
+#include <algorithm>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include "test_common.h"
 using StatsTracker = gc::StatsTracker;
 struct Bar : gc::GarbageCollected<Bar> {
@@ -46,10 +49,14 @@ void test_random() {
 template<typename C, typename T>
 struct Node : public C::template Enable<Node<C, T>> {
     // IMPORT_TYPES()
+    static constexpr bool gc_trivially_destructible = std::is_trivially_destructible_v<T>;
+    static constexpr bool gc_trivially_relocatable = std::is_trivially_copyable_v<T>;
+    // most nodes of the random graphs have a child or two, which then take no buffer of their own
+    using Children = C::template Array<Node<C, T>, 2>;
     T val{};
-    C::template Member<typename C::template Array<Node<C, T>>> children;
+    C::template Member<Children> children;
     Node() : children(this) {
-        children = C::template make<typename C::template Array<Node<C, T>>>();
+        children = C::template make<Children>();
     }
     GC_CLASS(children)
 };
@@ -134,6 +141,36 @@ void test_wb() {
     }
     gc::GcHeap::destroy();
 }
+void test_parentless_barrier() {
+    gc::GcOption option{};
+    option.max_heap_size = 16 * 1024 * 1024;
+    option.mode = gc::GcMode::INCREMENTAL;
+    gc::GcHeap::init(option);
+    {
+        auto &heap = gc::get_heap();
+        auto root = gc::Local<WBTestNode>::make();
+        root->left = gc::Local<WBTestNode>::make();
+        gc::GcPtr<WBTestNode> a = root->left;
+        a->left = gc::Local<WBTestNode>::make();
+        a->right = gc::Local<WBTestNode>::make();
+        a->right->left = gc::Local<WBTestNode>::make();
+        gc::Weak<WBTestNode> weak(gc::GcPtr<WBTestNode>(a->right->left));
+        heap.collect();
+        // the root is scanned, `a` is gray and everything below it white
+        heap.scan_roots();
+        gc::GcPtr<WBTestNode> moved = a->right->left;
+        a->right->left = nullptr;
+        // a plain store into an object not scanned yet, whose only owner then drops it. the barrier finds the
+        // object around the member, so nothing is shaded and the moved node dies with it in this cycle
+        a->left->left = moved;
+        a->left = nullptr;
+        a->right = nullptr;
+        while (heap.mark_some(1)) {}
+        heap.sweep();
+        GC_ASSERT(weak.expired(), "a store into an unscanned object should not shade");
+    }
+    gc::GcHeap::destroy();
+}
 
 void bench_short_lived_few_update() {
     printf("Running bench_short_lived_few_update\n");
@@ -461,8 +498,1244 @@ void test_hashmap() {
             printf("%s %s\n", k->c_str(), v->c_str());
         }
     }
+    {
+        auto map = gc::Local<Map>::make();
+        size_t n = 10000;
+        for (size_t i = 0; i < n; i++) {
+            auto k = gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i));
+            auto v = gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i * 2));
+            map->insert(k, v);
+        }
+        // keys compare by value, so this overwrites instead of adding
+        for (size_t i = 0; i < n; i += 2) {
+            auto k = gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i));
+            auto v = gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i * 3));
+            map->insert(k, v);
+        }
+        GC_ASSERT(map->size() == n, "invalid size");
+        for (size_t i = 0; i < n; i++) {
+            auto k = gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i));
+            GC_ASSERT(map->contains(k), "should contain");
+            GC_ASSERT(*map->at(k) == std::to_string(i % 2 == 0 ? i * 3 : i * 2), "invalid value");
+        }
+        auto missing = gc::Local<gc::Adaptor<std::string>>::make("missing");
+        GC_ASSERT(!map->contains(missing), "should not contain");
+        size_t count = 0;
+        for ([[maybe_unused]] auto [k, v] : *map) {
+            count++;
+        }
+        GC_ASSERT(count == n, "invalid iteration count");
+    }
+
+    gc::GcHeap::destroy();
+}
+void test_pod_array() {
+    using FloatArray = gc::GcPodArray<float>;
+    static_assert(gc::is_pointer_free<FloatArray>);
+    static_assert(gc::is_pointer_free<gc::Boxed<float>>);
+    static_assert(!gc::is_pointer_free<Node<GcPolicy, int>>);
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 16;
+        gc::GcHeap::init(option);
+        {
+            auto arrays = gc::Local<gc::GcVector<FloatArray>>::make();
+            for (int j = 0; j < 100; j++) {
+                auto v = gc::Local<FloatArray>::make();
+                GC_ASSERT(v->is_pointer_free(), "GcPodArray should be pointer-free");
+                v->reserve(10);
+                for (int i = 0; i < 100; i++) {
+                    v->push_back(static_cast<float>(i));
+                }
+                if (j % 10 == 0) {
+                    arrays->push_back(v);
+                }
+            }
+            for (auto &v : *arrays) {
+                auto span = v->span();
+                GC_ASSERT(span.size() == 100, "invalid size");
+                GC_ASSERT(std::accumulate(span.begin(), span.end(), 0.0f) == 4950.0f, "invalid sum");
+            }
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_string() {
+    static_assert(gc::is_pointer_free<gc::GcString>);
+    gc::GcOption option{};
+    option.mode = gc::GcMode::INCREMENTAL;
+    option.max_heap_size = 1024 * 64;
+    gc::GcHeap::init(option);
+    {
+        auto map = gc::Local<gc::GcHashMap<gc::GcString, gc::GcString>>::make();
+        for (int i = 0; i < 1000; i++) {
+            auto key = gc::GcString::make(std::to_string(i % 100));
+            auto value = gc::GcString::make(std::string(i % 37, 'x'));
+            GC_ASSERT(key->object_size() == sizeof(gc::GcString) + key->size() + 1, "bytes should be inline");
+            GC_ASSERT(std::strlen(value->c_str()) == value->size(), "should be null terminated");
+            map->insert(key, value);
+        }
+        GC_ASSERT(map->size() == 100, "invalid size");
+        for (int i = 900; i < 1000; i++) {
+            auto key = gc::GcString::make(std::to_string(i % 100));
+            GC_ASSERT(key->hash() == std::hash<std::string_view>{}(key->view()), "invalid hash");
+            GC_ASSERT(*map->at(key) == std::string(i % 37, 'x'), "invalid value");
+        }
+    }
+    gc::GcHeap::destroy();
+}
+void test_leaf_space() {
+    static_assert(gc::is_trivially_finalizable<gc::Boxed<float>>);
+    static_assert(gc::is_trivially_finalizable<gc::GcString>);
+    static_assert(!gc::is_trivially_finalizable<gc::Adaptor<std::string>>);
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 256;
+        gc::GcHeap::init(option);
+        {
+            auto boxes = gc::Local<gc::GcVector<gc::Boxed<int>>>::make();
+            auto strings = gc::Local<gc::GcVector<gc::Adaptor<std::string>>>::make();
+            for (int i = 0; i < 20000; i++) {
+                auto box = gc::Local<gc::Boxed<int>>::make(i);
+                // long enough to live on the C++ heap, so a missed destructor leaks
+                auto str = gc::Local<gc::Adaptor<std::string>>::make(std::string(40, 'a' + i % 26));
+                GC_ASSERT(box->in_leaf_space() && str->in_leaf_space(), "small pointer-free objects should be leaves");
+                // allocates from inside its constructor, which may run a collection while the slot is still pinned
+                auto pod = gc::Local<gc::GcPodArray<int>>::make(64, i);
+                GC_ASSERT(pod->in_leaf_space() && pod->span().back() == i, "invalid pod array");
+                if (i % 100 == 0) {
+                    boxes->push_back(box);
+                    strings->push_back(str);
+                }
+            }
+            GC_ASSERT(gc::get_heap().stats().n_collection_cycles > 0, "should have collected");
+            for (size_t i = 0; i < boxes->size(); i++) {
+                GC_ASSERT(boxes->at(i)->value == static_cast<int>(i * 100), "invalid box");
+                GC_ASSERT(*strings->at(i) == std::string(40, 'a' + i * 100 % 26), "invalid string");
+            }
+        }
+        gc::GcHeap::destroy();
+    }
+}
+struct Finalizable {
+    static inline std::atomic<int> n_live = 0;
+    std::string payload;
+    Finalizable(int i) : payload(40, 'a' + i % 26) { n_live++; }
+    ~Finalizable() { n_live--; }
+};
+void test_background_finalization() {
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 256;
+        option.background_finalization = true;
+        gc::GcHeap::init(option);
+        {
+            auto kept = gc::Local<gc::GcVector<gc::Adaptor<Finalizable>>>::make();
+            for (int i = 0; i < 20000; i++) {
+                // a leaf with a destructor, and a regular object that owns a spill buffer
+                auto obj = gc::Local<gc::Adaptor<Finalizable>>::make(i);
+                auto vec = gc::Local<gc::GcVector<gc::Boxed<int>>>::make();
+                for (int j = 0; j < 8; j++) {
+                    vec->push_back(gc::Local<gc::Boxed<int>>::make(j));
+                }
+                if (i % 100 == 0) {
+                    kept->push_back(obj);
+                }
+            }
+            GC_ASSERT(gc::get_heap().stats().n_collection_cycles > 0, "should have collected");
+            for (size_t i = 0; i < kept->size(); i++) {
+                GC_ASSERT(kept->at(i)->payload == std::string(40, 'a' + i * 100 % 26), "live object was finalized");
+            }
+        }
+        gc::GcHeap::destroy();
+        GC_ASSERT(Finalizable::n_live == 0, "every dead object should be finalized");
+    }
+}
+void test_weak_refs() {
+    using Key = gc::GcString;
+    using Value = gc::GcVector<Key>;
+    auto run_cycles = [](size_t n) {
+        auto &stats = gc::get_heap().stats();
+        auto target = stats.n_collection_cycles + n;
+        while (stats.n_collection_cycles < target) {
+            gc::Local<gc::Boxed<int>>::make(0);
+        }
+    };
+    std::vector<gc::GcOption> options;
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        options.push_back(gc::GcOption{.mode = mode, .max_heap_size = 1024 * 256});
+    }
+    options.push_back(gc::GcOption{.mode = gc::GcMode::STOP_THE_WORLD, .max_heap_size = 1024 * 256, .n_collector_threads = 4});
+    for (auto &option : options) {
+        gc::GcHeap::init(option);
+        {
+            auto map = gc::Local<gc::GcWeakHashMap<Key, Value>>::make();
+            std::vector<gc::Local<Key>> kept;
+            std::vector<gc::Weak<Key>> weak_keys;
+            size_t n = 1000;
+            {
+                std::vector<gc::Local<Key>> keys;
+                for (size_t i = 0; i < n; i++) {
+                    keys.push_back(Key::make(std::to_string(i)));
+                    weak_keys.emplace_back(keys.back());
+                }
+                for (size_t i = 0; i < n; i++) {
+                    auto value = gc::Local<Value>::make();
+                    // a value pointing back at its own key must not keep the entry alive
+                    value->push_back(keys[i]);
+                    if (i % 10 == 0) {
+                        kept.push_back(keys[i]);
+                        // reachable only through the value of a live key
+                        value->push_back(keys[i + 1]);
+                    }
+                    map->insert(keys[i], value);
+                }
+            }
+            run_cycles(3);
+            auto is_live = [](size_t i) { return i % 10 == 0 || i % 10 == 1; };
+            for (size_t i = 0; i < n; i++) {
+                GC_ASSERT(weak_keys[i].expired() != is_live(i), "weak reference should be cleared once its target is dead");
+                GC_ASSERT(map->contains(Key::make(std::to_string(i))) == is_live(i), "entry should live as long as its key");
+            }
+            GC_ASSERT(map->size() == n / 5, "invalid size");
+            for (auto &key : kept) {
+                auto value = map->at(key);
+                GC_ASSERT(*value->at(0) == *key && value->size() == 2, "invalid value");
+            }
+            map->erase(kept.front());
+            GC_ASSERT(!map->contains(kept.front()) && map->size() == n / 5 - 1, "erase failed");
+            size_t count = 0;
+            map->for_each([&](gc::GcPtr<Key> key, gc::GcPtr<Value> value) {
+                GC_ASSERT(*value->at(0) == *key, "invalid entry");
+                count++;
+            });
+            GC_ASSERT(count == map->size(), "invalid iteration count");
+            kept.clear();
+            run_cycles(3);
+            GC_ASSERT(map->empty(), "every key is dead");
+            GC_ASSERT(std::ranges::all_of(weak_keys, [](auto &weak) { return weak.expired(); }), "every target is dead");
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_soft_refs() {
+    using Key = gc::GcString;
+    auto run_cycles = [](size_t n) {
+        auto &stats = gc::get_heap().stats();
+        auto target = stats.n_collection_cycles + n;
+        while (stats.n_collection_cycles < target) {
+            gc::Local<gc::Boxed<int>>::make(0);
+        }
+    };
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            // the heap is nearly empty, so soft references hold on while weak ones let go
+            std::vector<gc::Soft<Key>> soft;
+            std::vector<gc::Weak<Key>> weak;
+            for (int i = 0; i < 100; i++) {
+                soft.emplace_back(Key::make(std::to_string(i)));
+                weak.emplace_back(Key::make(std::to_string(i)));
+            }
+            run_cycles(3);
+            for (int i = 0; i < 100; i++) {
+                // the concurrent collector keeps everything allocated while it marks, so the garbage spun up
+                // by `run_cycles` fills the heap and counts as pressure there
+                if (mode != gc::GcMode::CONCURRENT) {
+                    auto key = soft[i].lock();
+                    GC_ASSERT(key.get() && *key == *Key::make(std::to_string(i)), "soft reference should survive without pressure");
+                }
+                GC_ASSERT(weak[i].expired(), "weak reference should be cleared");
+            }
+            // a cache twice the size of the heap only works if soft references give way
+            std::vector<gc::Soft<Key>> cache;
+            for (int i = 0; i < 512; i++) {
+                cache.emplace_back(Key::make(std::string(4096, 'a' + i % 26)));
+            }
+            GC_ASSERT(gc::get_heap().stats().n_soft_refs_cleared > 0, "should have cleared soft references");
+            for (size_t i = 0; i < cache.size(); i++) {
+                if (auto value = cache[i].lock(); value.get()) {
+                    GC_ASSERT(value->size() == 4096 && value->view()[0] == char('a' + i % 26), "invalid cache entry");
+                }
+            }
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_out_of_memory() {
+    using Key = gc::GcString;
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            // everything is rooted, so nothing but `spare` can give way
+            std::vector<gc::Local<Key>> held;
+            std::vector<gc::Local<Key>> spare;
+            size_t n_handler_calls = 0;
+            gc::get_heap().set_low_memory_handler([&](size_t size) {
+                n_handler_calls++;
+                spare.clear();
+            });
+            for (int i = 0; i < 64; i++) {
+                spare.emplace_back(Key::make(std::string(4096, 's')));
+            }
+            bool out_of_memory = false;
+            try {
+                for (int i = 0; i < 1024; i++) {
+                    held.emplace_back(Key::make(std::string(4096, 'a' + i % 26)));
+                }
+            } catch (std::bad_alloc &) {
+                out_of_memory = true;
+            }
+            GC_ASSERT(out_of_memory, "should run out of memory");
+            GC_ASSERT(n_handler_calls > 0 && spare.empty(), "low memory handler should have been called");
+            for (size_t i = 0; i < held.size(); i++) {
+                GC_ASSERT(held[i]->size() == 4096 && held[i]->view()[0] == char('a' + i % 26), "rooted object corrupted");
+            }
+            // the heap is still usable once something is dropped
+            held.resize(held.size() / 2);
+            for (int i = 0; i < 16; i++) {
+                held.emplace_back(Key::make(std::string(4096, 'z')));
+            }
+            gc::get_heap().set_low_memory_handler(nullptr);
+        }
+        gc::GcHeap::destroy();
+    }
+}
+template<size_t N>
+struct ThrowingPayload {
+    std::array<char, N> bytes{};
+    explicit ThrowingPayload(bool fail) {
+        if (fail) {
+            throw std::runtime_error("constructor failed");
+        }
+    }
+};
+void test_throwing_constructor() {
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            auto expect_throw = [&](auto make) {
+                auto n_allocated = heap.stats().n_allocated.load();
+                bool thrown = false;
+                try {
+                    make();
+                } catch (std::exception &) {
+                    thrown = true;
+                }
+                GC_ASSERT(thrown, "constructor should have thrown");
+                GC_ASSERT(heap.stats().n_allocated == n_allocated, "failed allocation should not be counted");
+            };
+            // a leaf slot, a pooled block and regions of its own
+            expect_throw([] { gc::Local<gc::Adaptor<ThrowingPayload<64>>>::make(true); });
+            expect_throw([] { gc::Local<gc::Adaptor<ThrowingPayload<1024>>>::make(true); });
+            expect_throw([] { gc::Local<gc::Adaptor<ThrowingPayload<64 * 1024>>>::make(true); });
+            // the buffers do not fit in the heap, the object around them is already allocated when they are asked for
+            expect_throw([] { gc::Local<gc::GcPodArray<char>>::make(size_t{1} << 20); });
+            expect_throw([] { gc::Local<gc::Adaptor<std::pmr::vector<int>>>::make(size_t{1} << 20, 0); });
+            for (int i = 0; i < 1000; i++) {
+                gc::Local<gc::Adaptor<ThrowingPayload<1024>>>::make(false);
+            }
+        }
+        // fails on anything the throws left behind
+        gc::GcHeap::destroy();
+    }
+}
+void test_dynamic_heap() {
+    using Key = gc::GcString;
+    auto run_cycles = [](size_t n) {
+        auto &stats = gc::get_heap().stats();
+        auto target = stats.n_collection_cycles + n;
+        while (stats.n_collection_cycles < target) {
+            gc::Local<gc::Boxed<int>>::make(0);
+        }
+    };
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.initial_heap_size = 256 * 1024;
+        option.min_heap_size = 128 * 1024;
+        option.max_heap_size = 64 * 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            GC_ASSERT(heap.heap_limit() == option.initial_heap_size, "should start at the initial size");
+            // a live set far beyond the initial size
+            std::vector<gc::Local<Key>> live;
+            for (int i = 0; i < 1024; i++) {
+                live.emplace_back(Key::make(std::string(4096, 'a' + i % 26)));
+            }
+            run_cycles(2);
+            GC_ASSERT(heap.stats().n_heap_grows > 0 && heap.heap_limit() > 4 * 1024 * 1024, "heap should have grown");
+            for (size_t i = 0; i < live.size(); i++) {
+                GC_ASSERT(live[i]->view()[0] == char('a' + i % 26), "rooted object corrupted");
+            }
+            // and once it is gone the heap gives the room back
+            live.clear();
+            run_cycles(16);
+            GC_ASSERT(heap.stats().n_heap_shrinks > 0 && heap.heap_limit() < 1024 * 1024, "heap should have shrunk");
+            GC_ASSERT(heap.heap_limit() >= option.min_heap_size, "heap should not shrink below the minimum");
+            auto &resizes = heap.stats().heap_resizes;
+            GC_ASSERT(resizes.size() == heap.stats().n_heap_grows + heap.stats().n_heap_shrinks, "every resize should be recorded");
+            GC_ASSERT(resizes.back().new_limit == heap.heap_limit(), "last resize should be the current limit");
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_return_memory() {
+    using Key = gc::GcString;
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 256 * 1024 * 1024;
+    option.decommit_delay = 2;
+    gc::GcHeap::init(option);
+    {
+        auto &stats = gc::get_heap().stats();
+        size_t peak_rss = 0;
+        size_t peak_committed = 0;
+        {
+            // a burst of small pointer-free objects and large buffers, all alive at once
+            std::vector<gc::Local<Key>> burst;
+            for (int i = 0; i < 256 * 1024; i++) {
+                burst.emplace_back(Key::make(std::string(160, 'a' + i % 26)));
+            }
+            for (int i = 0; i < 32; i++) {
+                burst.emplace_back(Key::make(std::string(1024 * 1024, 'a' + i % 26)));
+            }
+            gc::get_heap().collect();
+            peak_rss = stats.resident_bytes;
+            peak_committed = stats.committed_bytes;
+        }
+        // the pages stay committed until they have been free for `decommit_delay` cycles.
+        // collecting explicitly, allocating garbage to get there would reuse them
+        gc::get_heap().collect();
+        GC_ASSERT(stats.decommitted_bytes == 0, "pages should not be decommitted as soon as they are free");
+        for (size_t i = 0; i < option.decommit_delay; i++) {
+            gc::get_heap().collect();
+        }
+        GC_ASSERT(stats.decommitted_bytes > 0, "free pages should have been decommitted");
+        GC_ASSERT(stats.committed_bytes + 64 * 1024 * 1024 < peak_committed, "committed memory should have dropped");
+        if (peak_rss > 0) {
+            GC_ASSERT(stats.resident_bytes + 64 * 1024 * 1024 < peak_rss, "resident memory should have dropped");
+        }
+        // decommitted pages are usable again
+        std::vector<gc::Local<Key>> again;
+        for (int i = 0; i < 64 * 1024; i++) {
+            again.emplace_back(Key::make(std::string(160, 'a' + i % 26)));
+        }
+        for (size_t i = 0; i < again.size(); i++) {
+            GC_ASSERT(again[i]->view()[0] == char('a' + i % 26), "reused page corrupted");
+        }
+        // small traceable objects come from the pools, whose pages go back the same way once they are empty
+        using NodeT = Node<GcPolicy, int>;
+        size_t pooled_rss = 0;
+        auto pooled_burst = [&] {
+            auto nodes = gc::Local<gc::GcVector<NodeT>>::make();
+            for (int i = 0; i < 256 * 1024; i++) {
+                nodes->push_back(gc::Local<NodeT>::make());
+            }
+            gc::get_heap().collect();
+            pooled_rss = stats.resident_bytes;
+            return stats.committed_bytes.load();
+        };
+        gc::get_heap().collect();
+        auto before = stats.committed_bytes.load();
+        auto first = pooled_burst();
+        auto first_rss = pooled_rss;
+        for (size_t i = 0; i <= option.decommit_delay; i++) {
+            gc::get_heap().collect();
+        }
+        auto after = stats.committed_bytes.load();
+        std::printf("pooled burst: committed %zu MiB before, %zu MiB at the peak, %zu MiB once dead\n",
+                    before >> 20, first >> 20, after >> 20);
+        GC_ASSERT(after + 16 * 1024 * 1024 < first, "committed memory should have dropped after the pooled burst");
+        GC_ASSERT(stats.pool_committed_bytes < 1024 * 1024, "the pools' pages should have been decommitted");
+        if (first_rss > 0) {
+            GC_ASSERT(stats.resident_bytes + 16 * 1024 * 1024 < first_rss, "resident memory should have dropped after the pooled burst");
+        }
+        // decommitted pool pages are usable again
+        auto second = pooled_burst();
+        GC_ASSERT(second <= first + 4 * 1024 * 1024, "a second burst should take no more than the first");
+    }
+    gc::GcHeap::destroy();
+}
+void test_container_limits() {
+    // a fake cgroup, the real one is whatever the test happens to run in
+    auto dir = std::filesystem::temp_directory_path() / "gc_test_cgroup";
+    std::filesystem::create_directories(dir);
+    auto write = [&](const char *name, const std::string &content) {
+        std::ofstream(dir / name) << content;
+    };
+    auto pressure = [](size_t total) {
+        return "some avg10=0.00 avg60=0.00 avg300=0.00 total=" + std::to_string(total) + "\n" +
+               "full avg10=0.00 avg60=0.00 avg300=0.00 total=" + std::to_string(total) + "\n";
+    };
+    write("memory.max", "max\n");
+    write("memory.current", "4194304\n");
+    write("memory.pressure", pressure(0));
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 256 * 1024 * 1024;
+    option.container_aware = true;
+    option.cgroup_path = dir.string();
+    option.pressure_poll_ms = 10;
+    gc::GcHeap::init(option);
+    GC_ASSERT(gc::get_heap().max_heap_size() == option.max_heap_size, "an unlimited cgroup should leave the heap alone");
+    gc::GcHeap::destroy();
+    write("memory.max", "104857600\n");
+    gc::GcHeap::init(option);
+    {
+        auto &heap = gc::get_heap();
+        GC_ASSERT(heap.max_heap_size() == static_cast<size_t>((104857600 - 4194304) * option.container_heap_fraction), "heap should fit the cgroup");
+        auto obj = gc::Local<gc::Boxed<int>>::make(0);
+        auto cycles = heap.stats().n_collection_cycles.load();
+        // a second of stalls within the poll interval
+        write("memory.pressure", pressure(1000 * 1000));
+        while (heap.stats().n_pressure_events == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // the heap is nowhere near full, yet the next allocation collects
+        gc::Local<gc::Boxed<int>>::make(1);
+        GC_ASSERT(heap.stats().n_collection_cycles > cycles, "memory pressure should bring the collection forward");
+        GC_ASSERT(obj->value == 0, "rooted object corrupted");
+    }
+    gc::GcHeap::destroy();
+    // a cgroup at its limit, mostly with page cache, leaves the heap its minimum or its own limit
+    write("memory.current", "104857600\n");
+    write("memory.pressure", pressure(0));
+    gc::GcHeap::init(option);
+    GC_ASSERT(gc::get_heap().max_heap_size() == option.max_heap_size, "a full cgroup should leave the heap its own limit");
+    gc::Local<gc::Boxed<int>>::make(0);
+    gc::GcHeap::destroy();
+    option.min_heap_size = 16 * 1024 * 1024;
+    gc::GcHeap::init(option);
+    GC_ASSERT(gc::get_heap().max_heap_size() == option.min_heap_size, "a full cgroup should leave the heap its minimum");
+    gc::GcHeap::destroy();
+    std::filesystem::remove_all(dir);
+}
+void test_external_memory() {
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 16 * 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            // tiny objects holding large buffers, the heap alone would never fill up
+            for (int i = 0; i < 256; i++) {
+                gc::Local<gc::Adaptor<std::string>>::make(1024 * 1024, 'a');
+            }
+            GC_ASSERT(heap.stats().n_collection_cycles > 0, "external memory should trigger collections");
+            GC_ASSERT(heap.external_memory() < 64 * 1024 * 1024, "dead buffers should have been collected");
+            // growing in place is reported explicitly
+            auto s = gc::Local<gc::Adaptor<std::string>>::make();
+            auto before = heap.external_memory();
+            s->resize(4 * 1024 * 1024);
+            s->update_external_memory();
+            GC_ASSERT(heap.external_memory() >= before + 4 * 1024 * 1024, "growth should be reported");
+            // and so is memory nothing else knows about
+            auto cycles = heap.stats().n_collection_cycles.load();
+            heap.adjust_external_memory(64 * 1024 * 1024);
+            gc::Local<gc::Boxed<int>>::make(0);
+            heap.adjust_external_memory(-64 * 1024 * 1024);
+            GC_ASSERT(heap.stats().n_collection_cycles > cycles, "external memory should trigger a collection");
+        }
+        GC_ASSERT(gc::get_heap().external_memory() >= 0, "external memory should never go negative");
+        gc::GcHeap::destroy();
+    }
+}
+void test_pmr_adaptor() {
+    using Vec = gc::Adaptor<std::pmr::vector<std::pmr::string>>;
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 16 * 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            auto vec = gc::Local<Vec>::make();
+            GC_ASSERT(vec->get_allocator().resource() == heap.memory_resource(vec->pool_idx()), "should allocate from the pool of its owner");
+            for (int i = 0; i < 1000; i++) {
+                vec->emplace_back(std::string(100, 'a' + i % 26));
+            }
+            GC_ASSERT(vec->back().get_allocator().resource() == heap.memory_resource(vec->pool_idx()), "elements should share the allocator");
+            GC_ASSERT(heap.external_memory() == 0, "buffers in the heap are not external");
+            // an allocator passed explicitly is kept
+            auto other = gc::Local<Vec>::make(std::pmr::new_delete_resource());
+            GC_ASSERT(other->get_allocator().resource() == std::pmr::new_delete_resource(), "explicit allocator should be kept");
+            // buffers count toward the heap limit, so garbage in them gets collected
+            for (int i = 0; i < 64; i++) {
+                auto garbage = gc::Local<gc::Adaptor<std::pmr::vector<int>>>::make(256 * 1024, i);
+            }
+            GC_ASSERT(heap.stats().n_collection_cycles > 0, "buffers should trigger collections");
+            for (int i = 0; i < 1000; i++) {
+                GC_ASSERT((*vec)[i].size() == 100 && (*vec)[i][0] == 'a' + i % 26, "vector corrupted");
+            }
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_compaction() {
+    using Key = gc::GcString;
+    using Vec = gc::GcVector<Key>;
+    using NodeT = Node<GcPolicy, int>;
+    struct Result {
+        double occupancy;
+        size_t committed;
+        size_t n_moved;
+        size_t pool_peak;
+        size_t pool_committed;
+    };
+    // a long running churn over a set of short strings, most of which are dropped at the end.
+    // the survivors are left spread thinly over the leaf pages unless compaction packs them.
+    // alongside, the same churn over small traceable nodes with a child each, whose pool pages are packed alike
+    auto churn = [](bool compaction) {
+        gc::GcOption option{};
+        option.mode = gc::GcMode::STOP_THE_WORLD;
+        option.max_heap_size = 64 * 1024 * 1024;
+        option.compaction = compaction;
+        gc::GcHeap::init(option);
+        Result result{};
+        {
+            auto &heap = gc::get_heap();
+            auto &stats = heap.stats();
+            const size_t n = 100000;
+            std::vector<std::string> expected(n);
+            std::vector<int> expected_val(n);
+            auto vec = gc::Local<Vec>::make();
+            auto nodes = gc::Local<gc::GcVector<NodeT>>::make();
+            auto make_node = [](int val) {
+                auto node = gc::Local<NodeT>::make();
+                auto child = gc::Local<NodeT>::make();
+                node->val = val;
+                child->val = -val;
+                node->children->push_back(child);
+                return node;
+            };
+            for (size_t i = 0; i < n; i++) {
+                expected[i] = "s" + std::to_string(i);
+                expected_val[i] = static_cast<int>(i);
+                vec->push_back(Key::make(expected[i]));
+                nodes->push_back(make_node(expected_val[i]));
+            }
+            Rng rng(42);
+            for (int round = 0; round < 8; round++) {
+                for (size_t k = 0; k < n / 4; k++) {
+                    auto i = rng.pcg32() % n;
+                    expected[i] = "r" + std::to_string(round) + "_" + std::to_string(i);
+                    expected_val[i] = round * static_cast<int>(n) + static_cast<int>(i);
+                    vec->set(i, Key::make(expected[i]));
+                    nodes->set(i, make_node(expected_val[i]));
+                }
+                heap.collect();
+            }
+            result.pool_peak = stats.pool_committed_bytes;
+            auto weak = gc::Weak<Key>(gc::GcPtr<Key>((*vec)[n / 2]));
+            for (size_t i = 0; i < n; i++) {
+                if (i % 10 != 0) {
+                    vec->set(i, gc::GcPtr<Key>());
+                    nodes->set(i, gc::GcPtr<NodeT>());
+                }
+            }
+            heap.collect();
+            result.occupancy = stats.leaf_occupancy;
+            result.n_moved = stats.n_objects_moved;
+            // the emptied pages are given back after `decommit_delay` more cycles
+            for (size_t i = 0; i < option.decommit_delay; i++) {
+                heap.collect();
+            }
+            result.committed = stats.committed_bytes;
+            result.pool_committed = stats.pool_committed_bytes;
+            auto check_nodes = [&] {
+                for (size_t i = 0; i < n; i += 10) {
+                    auto &node = (*nodes)[i];
+                    GC_ASSERT(node->val == expected_val[i], "moved node corrupted");
+                    GC_ASSERT(node->children->size() == 1 && node->children->at(0)->val == -expected_val[i], "moved child corrupted");
+                }
+            };
+            for (size_t i = 0; i < n; i += 10) {
+                GC_ASSERT((*vec)[i]->view() == expected[i], "moved string corrupted");
+            }
+            check_nodes();
+            auto locked = weak.lock();
+            GC_ASSERT(locked.get() && locked->view() == expected[n / 2], "weak reference should follow the moved object");
+            // moved objects can be allocated next to and collected again
+            for (int i = 0; i < 100000; i++) {
+                Key::make("garbage");
+                make_node(i);
+            }
+            heap.collect();
+            for (size_t i = 0; i < n; i += 10) {
+                GC_ASSERT((*vec)[i]->view() == expected[i], "moved string corrupted");
+            }
+            check_nodes();
+        }
+        gc::GcHeap::destroy();
+        return result;
+    };
+    auto before = churn(false);
+    auto after = churn(true);
+    std::printf("leaf occupancy %.3f -> %.3f, committed %lldKB -> %lldKB, %lld objects moved\n",
+                before.occupancy, after.occupancy, before.committed / 1024, after.committed / 1024, after.n_moved);
+    // with a tenth of the nodes left, hardly a pool page is empty unless compaction packs them
+    std::printf("pool pages committed %lldKB at the peak, %lldKB after the drop without compaction, %lldKB with it\n",
+                before.pool_peak / 1024, before.pool_committed / 1024, after.pool_committed / 1024);
+    GC_ASSERT(before.n_moved == 0, "nothing should move without compaction");
+    GC_ASSERT(after.n_moved > 0, "sparse pages should have been evacuated");
+    GC_ASSERT(after.occupancy > 2 * before.occupancy, "compaction should have reduced fragmentation");
+    GC_ASSERT(2 * after.pool_committed < before.pool_committed, "compaction should have given pool pages back");
+}
+void test_gc_bytes() {
+    // streams a file into gc buffers and back out. the bytes are read straight into the heap and written
+    // from there, the only copies are the ones the kernel makes
+    auto dir = std::filesystem::temp_directory_path();
+    auto in_path = dir / "gc_test_bytes_in.bin";
+    auto out_path = dir / "gc_test_bytes_out.bin";
+    const size_t chunk_size = 192;// small enough for the leaf space
+    const size_t n_chunks = 4096;
+    std::string content(chunk_size * n_chunks, '\0');
+    Rng rng(7);
+    for (auto &c : content) {
+        c = static_cast<char>(rng.pcg32());
+    }
+    std::ofstream(in_path, std::ios::binary).write(content.data(), content.size());
+
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 4 * 1024 * 1024;
+    option.compaction = true;
+    gc::GcHeap::init(option);
+    {
+        auto &heap = gc::get_heap();
+        std::vector<gc::Pin<gc::GcBytes>> chunks;
+        std::vector<const std::byte *> addresses;
+        auto in = std::fopen(in_path.string().c_str(), "rb");
+        GC_ASSERT(in, "can't open the input");
+        while (true) {
+            gc::Pin<gc::GcBytes> chunk = gc::GcBytes::make_for_overwrite(chunk_size);
+            GC_ASSERT(chunk->is_pinned(), "chunk should be pinned");
+            auto n = std::fread(chunk->data(), 1, chunk->size(), in);
+            if (n == 0) {
+                break;
+            }
+            GC_ASSERT(n == chunk_size, "short read");
+            addresses.push_back(chunk->data());
+            chunks.push_back(std::move(chunk));
+            // churn in between, collections run and compaction packs the strings around the buffers
+            for (int i = 0; i < 32; i++) {
+                gc::GcString::make("garbage");
+            }
+        }
+        std::fclose(in);
+        heap.collect();
+        GC_ASSERT(heap.stats().n_collection_cycles > 1, "collections should have run while streaming");
+        auto out = std::fopen(out_path.string().c_str(), "wb");
+        GC_ASSERT(out, "can't open the output");
+        for (size_t i = 0; i < chunks.size(); i++) {
+            GC_ASSERT(chunks[i]->data() == addresses[i], "pinned buffer moved");
+            GC_ASSERT(std::fwrite(chunks[i]->data(), 1, chunks[i]->size(), out) == chunk_size, "short write");
+        }
+        std::fclose(out);
+        std::ifstream written(out_path, std::ios::binary);
+        std::string copy((std::istreambuf_iterator<char>(written)), std::istreambuf_iterator<char>());
+        GC_ASSERT(copy == content, "bytes should round trip");
 
+        // a pin keeps a relocatable object in place too, and dropping the last one releases it
+        auto strings = gc::Local<gc::GcVector<gc::GcString>>::make();
+        for (int i = 0; i < 4096; i++) {
+            strings->push_back(gc::GcString::make(std::to_string(i)));
+        }
+        gc::Pin<gc::GcString> pinned = gc::GcPtr<gc::GcString>((*strings)[4032]);
+        auto before = pinned.get().get();
+        for (int i = 0; i < 4096; i++) {
+            if (i % 64 != 0) {
+                strings->set(i, gc::GcPtr<gc::GcString>());
+            }
+        }
+        heap.collect();
+        GC_ASSERT(pinned.get().get() == before && *pinned == "4032", "pinned string moved");
+        GC_ASSERT(gc::GcPtr<gc::GcString>((*strings)[4032]).get() == before, "pinned string moved");
+        auto copy_of_pin = pinned;
+        pinned = {};
+        GC_ASSERT(copy_of_pin->is_pinned(), "the copy still pins");
+        copy_of_pin = {};
+        GC_ASSERT(!gc::GcPtr<gc::GcString>((*strings)[4032])->is_pinned(), "pin should be released");
+    }
     gc::GcHeap::destroy();
+    std::filesystem::remove(in_path);
+    std::filesystem::remove(out_path);
+}
+void test_immortal_space() {
+    using Box = gc::Boxed<int>;
+    using Vec = gc::GcVector<Box>;
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 8 * 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            auto &stats = heap.stats();
+            auto run_cycles = [&](size_t n) {
+                auto target = stats.n_collection_cycles + n;
+                while (stats.n_collection_cycles < target) {
+                    gc::Local<Box>::make(0);
+                }
+            };
+            // permanent data, built once
+            const int n = 20000;
+            auto scene = gc::make_immortal<Vec>();
+            for (int i = 0; i < n; i++) {
+                scene->push_back(gc::make_immortal<Box>(i));
+            }
+            GC_ASSERT(scene->begin()->gc_object_container()->is_immortal(), "elements should be immortal");
+            GC_ASSERT(stats.n_immortal_objects == n + 1, "immortal objects should be counted");
+            // an immortal object is all that keeps this one alive
+            auto anchor = gc::make_immortal<Vec>();
+            anchor->push_back(gc::Local<Box>::make(-1));
+            gc::Weak<Box> mortal{gc::GcPtr<Box>((*anchor)[0])};
+            // and a promoted string stays around without anything pointing at it
+            gc::Weak<gc::GcString> name;
+            {
+                auto s = gc::GcString::make("immortal");
+                gc::promote_to_immortal(s);
+                name = gc::Weak<gc::GcString>(s);
+            }
+            scene = nullptr;
+            run_cycles(4);
+            GC_ASSERT(!mortal.expired() && mortal.lock()->value == -1, "referenced from an immortal object");
+            GC_ASSERT(!name.expired() && *name.lock() == "immortal", "promoted string collected");
+            // only the card holding the anchor's element is traced, not the scene
+            GC_ASSERT(stats.n_dirty_cards <= 2, "clean cards should not be traced");
+            anchor->set(0, gc::make_immortal<Box>(-2));
+            run_cycles(4);
+            GC_ASSERT(mortal.expired(), "no longer referenced from the immortal space");
+            GC_ASSERT(stats.n_dirty_cards == 0, "the immortal space should be clean");
+            // a container promoted in place is traced as a whole, its elements stay mortal
+            auto promoted = gc::Local<Vec>::make();
+            for (int i = 0; i < 100; i++) {
+                promoted->push_back(gc::Local<Box>::make(i));
+            }
+            gc::promote_to_immortal(promoted);
+            gc::Weak<Vec> weak_promoted(promoted);
+            promoted = nullptr;
+            run_cycles(4);
+            auto locked = weak_promoted.lock();
+            GC_ASSERT(locked.get() && locked->size() == 100, "promoted vector collected");
+            for (int i = 0; i < 100; i++) {
+                GC_ASSERT((*locked)[i]->value == i, "element of a promoted vector collected");
+            }
+            if (mode != gc::GcMode::STOP_THE_WORLD) {
+                // promoted while marking, after the immortal space was scanned, and then dropped by its only
+                // mortal owner before marking got there. the barrier does not see the old value, so the promotion
+                // has to shade it
+                using NodeT = Node<GcPolicy, int>;
+                auto head = gc::Local<NodeT>::make();
+                gc::GcPtr<NodeT> table = head.get();
+                // a long chain, so that the table is reached late
+                for (int i = 0; i < 5000; i++) {
+                    auto next = gc::Local<NodeT>::make();
+                    table->children->push_back(next);
+                    table = next.get();
+                }
+                for (int i = 0; i < 200; i++) {
+                    auto row = gc::Local<NodeT>::make();
+                    for (int j = 0; j < 50; j++) {
+                        auto cell = gc::Local<NodeT>::make();
+                        cell->val = j;
+                        row->children->push_back(cell);
+                    }
+                    table->children->push_back(row);
+                }
+                std::vector<gc::Weak<NodeT>> rows;
+                for (int i = 0; i < 200; i++) {
+                    while (!heap.need_write_barrier()) {
+                        gc::Local<Box>::make(0);
+                    }
+                    gc::GcPtr<NodeT> row = table->children->at(i);
+                    gc::promote_to_immortal(row);
+                    rows.emplace_back(row);
+                    table->children->set(i, gc::GcPtr<NodeT>());
+                }
+                head = nullptr;
+                run_cycles(4);
+                for (auto &weak : rows) {
+                    auto row = weak.lock();
+                    GC_ASSERT(row.get() && row->children->size() == 50, "row promoted while marking collected");
+                    for (int j = 0; j < 50; j++) {
+                        GC_ASSERT(row->children->at(j)->val == j, "child of a row promoted while marking collected");
+                    }
+                }
+            }
+        }
+        gc::GcHeap::destroy();
+    }
+}
+void test_multiple_heaps() {
+    using NodeT = Node<GcPolicy, int>;
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 16 * 1024 * 1024;
+    gc::GcHeap::init(option);
+    {
+        auto &default_heap = gc::get_heap();
+        auto kept = gc::Local<NodeT>::make();
+        kept->val = 42;
+        {
+            // scopes nest, and the default heap comes back once they end
+            auto other = gc::GcHeap::create(option);
+            gc::HeapScope scope(*other);
+            GC_ASSERT(&gc::get_heap() == other.get(), "the scope should make the heap current");
+            auto node = gc::Local<NodeT>::make();
+            node->val = 1;
+            GC_ASSERT(other->stats().n_allocated > 0 && default_heap.stats().n_allocated == 2, "allocated from the wrong heap");
+            other->collect();
+            GC_ASSERT(node->val == 1, "collected while rooted");
+        }
+        GC_ASSERT(&gc::get_heap() == &default_heap, "the default heap should be current again");
+        GC_ASSERT(default_heap.stats().n_collection_cycles == 0 && kept->val == 42, "the other heap collected this one");
+        {
+            // objects of the default heap touched while another heap is current keep to their own heap: the buffers
+            // their containers grow and the roots taken on them outlive the other one
+            std::vector<gc::Local<NodeT>> nodes;
+            for (int i = 0; i < 1000; i++) {
+                nodes.push_back(gc::Local<NodeT>::make());
+                nodes.back()->val = i;
+            }
+            auto other = gc::GcHeap::create(option);
+            gc::Local<NodeT> held;
+            {
+                gc::HeapScope scope(*other);
+                for (auto &node : nodes) {
+                    kept->children->push_back(node);
+                }
+                held = gc::GcPtr<NodeT>(kept->children->at(500));
+            }
+            GC_ASSERT(other->stats().n_allocated == 0, "allocated from the wrong heap");
+            other.reset();
+            nodes.clear();
+            kept->children->set(500, gc::GcPtr<NodeT>());
+            default_heap.collect();
+            GC_ASSERT(held->val == 500, "root taken under another heap collected");
+            for (int i = 0; i < 1000; i++) {
+                GC_ASSERT(i == 500 || kept->children->at(i)->val == i, "buffer grown under another heap corrupted");
+            }
+            kept->children = gc::Local<NodeT::Children>::make();
+            default_heap.collect();
+        }
+
+        // shards: each thread churns on a heap of its own, the time for the same work per shard shows how it scales
+        auto run_shards = [&](size_t n_shards) {
+            std::vector<std::shared_ptr<gc::GcHeap>> heaps;
+            for (size_t i = 0; i < n_shards; i++) {
+                heaps.push_back(gc::GcHeap::create(option));
+            }
+            auto t0 = std::chrono::high_resolution_clock::now();
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < n_shards; i++) {
+                threads.emplace_back([&heaps, i] {
+                    gc::HeapScope scope(*heaps[i]);
+                    auto root = gc::Local<NodeT>::make();
+                    for (int j = 0; j < 200000; j++) {
+                        auto node = gc::Local<NodeT>::make();
+                        node->val = j;
+                        if (j % 100 == 0) {
+                            root->children->push_back(node);
+                        }
+                    }
+                    GC_ASSERT(root->children->size() == 2000, "lost nodes");
+                    for (int j = 0; j < 2000; j++) {
+                        GC_ASSERT(root->children->at(j)->val == j * 100, "node corrupted");
+                    }
+                });
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+            for (auto &heap : heaps) {
+                GC_ASSERT(heap->stats().n_collection_cycles > 0, "every shard should have collected");
+            }
+            return std::chrono::duration<double>(t1 - t0).count();
+        };
+        auto one = run_shards(1);
+        auto four = run_shards(4);
+        std::printf("1 shard: %.3fs, 4 shards: %.3fs, scaling %.2fx of 4x\n", one, four, 4 * one / four);
+    }
+    gc::GcHeap::destroy();
+}
+void test_fast_teardown() {
+    using NodeT = Node<GcPolicy, int>;
+    auto populate = [] {
+        // everything stays reachable until the end, the teardown has the whole heap to get rid of
+        auto root = gc::Local<NodeT>::make();
+        auto finalizables = gc::Local<gc::GcVector<gc::Adaptor<Finalizable>>>::make();
+        for (int i = 0; i < 200000; i++) {
+            auto node = gc::Local<NodeT>::make();
+            node->val = i;
+            root->children->push_back(node);
+            if (i % 10 == 0) {
+                finalizables->push_back(gc::Local<gc::Adaptor<Finalizable>>::make(i));
+            }
+        }
+        GC_ASSERT(Finalizable::n_live == 20000, "finalizable objects missing");
+    };
+    auto run = [&](bool fast, bool leak_check) {
+        gc::GcOption option{};
+        option.mode = gc::GcMode::STOP_THE_WORLD;
+        option.max_heap_size = 256 * 1024 * 1024;
+        option.fast_teardown = fast;
+        option.teardown_leak_check = leak_check;
+        gc::GcHeap::init(option);
+        populate();
+        GC_ASSERT(gc::get_heap().stats().n_collection_cycles == 0, "the heap should not have collected yet");
+        auto t0 = std::chrono::high_resolution_clock::now();
+        gc::GcHeap::destroy();
+        auto t1 = std::chrono::high_resolution_clock::now();
+        // the trivially destructible nodes are skipped, but nothing with a real destructor is
+        GC_ASSERT(Finalizable::n_live == 0, "every destructor should have run");
+        return std::chrono::duration<double>(t1 - t0).count();
+    };
+    auto full = run(false, false);
+    auto fast = run(true, false);
+    auto checked = run(true, true);
+    std::printf("teardown: full %.3fs, fast %.3fs, fast with leak check %.3fs\n", full, fast, checked);
+}
+struct ImageRoot : gc::Traceable {
+    static constexpr bool gc_imageable = true;
+    gc::Member<gc::GcHashMap<gc::GcString, gc::GcVector<gc::Boxed<int>>>> table;
+    gc::Member<gc::GcPodArray<double>> samples;
+    gc::Member<gc::GcBytes> blob;
+    gc::Member<ImageRoot> self;
+    ImageRoot() : table(this), samples(this), blob(this), self(this) {}
+    GC_CLASS(table, samples, blob, self)
+};
+void test_heap_image() {
+    using Table = gc::GcHashMap<gc::GcString, gc::GcVector<gc::Boxed<int>>>;
+    auto path = (std::filesystem::temp_directory_path() / "gc_test_heap_image.bin").string();
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 64 * 1024 * 1024;
+    gc::GcHeap::init(option);
+    size_t n_objects = 0;
+    {
+        auto root = gc::Local<ImageRoot>::make();
+        root->self = root;
+        root->table = gc::Local<Table>::make();
+        for (int i = 0; i < 1000; i++) {
+            auto values = gc::Local<gc::GcVector<gc::Boxed<int>>>::make();
+            for (int j = 0; j < i % 10; j++) {
+                values->push_back(gc::Local<gc::Boxed<int>>::make(i * j));
+            }
+            root->table->insert(gc::GcString::make("key" + std::to_string(i)), values);
+            n_objects += 2 + i % 10;
+        }
+        root->samples = gc::Local<gc::GcPodArray<double>>::make();
+        for (int i = 0; i < 10000; i++) {
+            root->samples->push_back(i * 0.5);
+        }
+        root->blob = gc::GcBytes::make_for_overwrite(100000);
+        for (size_t i = 0; i < root->blob->size(); i++) {
+            root->blob->data()[i] = static_cast<std::byte>(i * 7);
+        }
+        n_objects += 4;
+        GC_ASSERT(gc::save_image(root.get(), path), "failed to write the image");
+    }
+    gc::GcHeap::destroy();
+
+    option.mode = gc::GcMode::INCREMENTAL;
+    option.max_heap_size = 1024 * 1024;
+    gc::GcHeap::init(option);
+    {
+        GC_ASSERT(gc::load_image<Table>(path).get() == nullptr, "an image of another root type should be rejected");
+        GC_ASSERT(gc::load_image<ImageRoot>(path + ".missing").get() == nullptr, "a missing image should be rejected");
+        {
+            // the relocations come last, point the final one past the end of the data
+            std::ifstream in(path, std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            uint64_t relocation = uint64_t{1} << 40;
+            std::memcpy(bytes.data() + bytes.size() - sizeof(relocation), &relocation, sizeof(relocation));
+            std::ofstream(path + ".corrupt", std::ios::binary).write(bytes.data(), bytes.size());
+            GC_ASSERT(gc::load_image<ImageRoot>(path + ".corrupt").get() == nullptr, "a corrupted image should be rejected");
+            std::filesystem::remove(path + ".corrupt");
+        }
+        auto root = gc::load_image<ImageRoot>(path);
+        GC_ASSERT(root.get() != nullptr, "failed to load the image");
+        GC_ASSERT(root->self.get() == root.get(), "cycle not relocated");
+        GC_ASSERT(gc::get_heap().stats().n_image_objects == n_objects, "image object count mismatch");
+        // mortal objects may reference the image, collections leave it alone
+        auto holders = gc::Local<gc::GcVector<ImageRoot>>::make();
+        for (int i = 0; i < 100000; i++) {
+            auto holder = gc::Local<gc::GcVector<ImageRoot>>::make();
+            holder->push_back(root);
+            if (i % 1000 == 0) {
+                holders->push_back(root);
+            }
+        }
+        GC_ASSERT(gc::get_heap().stats().n_collection_cycles > 0, "should have collected");
+        for (int i = 0; i < 1000; i++) {
+            auto values = root->table->at(gc::GcString::make("key" + std::to_string(i)));
+            GC_ASSERT(values->size() == static_cast<size_t>(i % 10), "values lost");
+            for (int j = 0; j < i % 10; j++) {
+                GC_ASSERT(values->at(j)->value == i * j, "value corrupted");
+            }
+        }
+        GC_ASSERT(root->samples->size() == 10000 && root->samples->at(9999) == 9999 * 0.5, "samples corrupted");
+        gc::Pin<gc::GcBytes> blob(root->blob.get());
+        for (size_t i = 0; i < blob->size(); i++) {
+            GC_ASSERT(blob->data()[i] == static_cast<std::byte>(i * 7), "blob corrupted");
+        }
+        GC_ASSERT(holders->size() == 100 && holders->at(99).get() == root.get(), "holder lost the image root");
+    }
+    gc::GcHeap::destroy();
+    std::filesystem::remove(path);
+}
+void test_region_table() {
+    using NodeT = Node<GcPolicy, int>;
+    gc::GcOption option{};
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    option.max_heap_size = 64 * 1024 * 1024;
+    gc::GcHeap::init(option);
+    {
+        auto &heap = gc::get_heap();
+        // every byte of an object leads back to it, the byte after it does not
+        auto check = [&](const gc::GcObjectContainer *obj) {
+            auto begin = reinterpret_cast<const std::byte *>(obj);
+            auto size = obj->allocation_size();
+            GC_ASSERT(heap.contains(begin), "object should be in the reserved range");
+            for (auto offset : {size_t{0}, size_t{8}, size / 2, size - 1}) {
+                GC_ASSERT(heap.object_containing(begin + offset) == obj, "interior pointer should find its object");
+            }
+            GC_ASSERT(heap.object_containing(begin + size) != obj, "the end is not part of the object");
+        };
+        std::vector<gc::Local<NodeT>> nodes;
+        std::vector<gc::Local<gc::GcBytes>> blobs;
+        for (int i = 0; i < 1000; i++) {
+            nodes.push_back(gc::Local<NodeT>::make());
+            // from the leaf space, the pools and spans of their own
+            blobs.push_back(gc::GcBytes::make(100));
+            blobs.push_back(gc::GcBytes::make(8 * 1024 + i));
+            if (i % 100 == 0) {
+                blobs.push_back(gc::GcBytes::make(200 * 1024 + i));
+            }
+        }
+        for (auto &node : nodes) {
+            check(node.get().gc_object_container());
+        }
+        for (auto &blob : blobs) {
+            check(blob.get().gc_object_container());
+        }
+        int on_stack = 0;
+        auto on_heap = std::make_unique<int>(0);
+        GC_ASSERT(!heap.contains(&on_stack) && !heap.object_containing(&on_stack), "stack is not in the heap");
+        GC_ASSERT(!heap.object_containing(on_heap.get()), "malloc'd memory is not in the heap");
+
+        auto small = reinterpret_cast<const std::byte *>(gc::Local<NodeT>::make().get().gc_object_container());
+        auto large_blob = gc::GcBytes::make(1024 * 1024);
+        auto large = reinterpret_cast<const std::byte *>(large_blob.get().gc_object_container());
+        // the statistic is taken after each sweep
+        heap.collect();
+        auto committed = heap.stats().committed_bytes.load();
+        large_blob = nullptr;
+        heap.collect();
+        GC_ASSERT(!heap.object_containing(small + 8), "freed object should not be found");
+        GC_ASSERT(!heap.object_containing(large + 4096), "freed large object should not be found");
+        GC_ASSERT(heap.stats().committed_bytes + 1024 * 1024 <= committed, "large object's regions should be decommitted");
+        for (auto &node : nodes) {
+            check(node.get().gc_object_container());
+        }
+    }
+    gc::GcHeap::destroy();
+}
+void test_iterators() {
+    using NodeT = Node<GcPolicy, int>;
+    using Vec = gc::GcVector<NodeT>;
+    using Map = gc::GcHashMap<gc::Adaptor<std::string>, NodeT>;
+    static_assert(std::ranges::contiguous_range<Vec>);
+    static_assert(std::ranges::forward_range<Map>);
+    static_assert(std::ranges::view<Vec::View>);
+    static_assert(std::ranges::view<Map::View>);
+    gc::GcOption option{};
+    option.mode = gc::GcMode::INCREMENTAL;
+    option.max_heap_size = 1024 * 512;
+    gc::GcHeap::init(option);
+    {
+        auto vec = gc::Local<Vec>::make();
+        auto map = gc::Local<Map>::make();
+        auto n = 1000;
+        for (int i = 0; i < n; i++) {
+            auto node = gc::Local<NodeT>::make();
+            node->val = i;
+            vec->push_back(node);
+            map->insert(gc::Local<gc::Adaptor<std::string>>::make(std::to_string(i)), node);
+            // garbage, so that a few incremental cycles run while the containers are growing
+            for (int j = 0; j < 4; j++) {
+                gc::Local<NodeT>::make();
+            }
+        }
+        auto view = vec->view();
+        auto odd = std::ranges::count_if(view, [](auto &node) { return node->val % 2 == 1; });
+        GC_ASSERT(odd == n / 2, "invalid count");
+        int sum = 0;
+        for (auto [k, v] : map->view() | std::views::take(n)) {
+            GC_ASSERT(std::to_string(v->val) == *k, "invalid entry");
+            sum += v->val;
+        }
+        GC_ASSERT(sum == n * (n - 1) / 2, "invalid sum");
+    }
+    gc::GcHeap::destroy();
+}
+void test_inline_vector() {
+    using Box = gc::Boxed<int>;
+    using Vec = gc::GcVector<Box, 3>;
+    static_assert(sizeof(Vec) == sizeof(gc::GcVector<Box>) + 3 * sizeof(gc::Member<Box>));
+    for (auto mode : {gc::GcMode::STOP_THE_WORLD, gc::GcMode::INCREMENTAL, gc::GcMode::CONCURRENT}) {
+        gc::GcOption option{};
+        option.mode = mode;
+        option.max_heap_size = 4 * 1024 * 1024;
+        gc::GcHeap::init(option);
+        {
+            auto &heap = gc::get_heap();
+            size_t n = 1000;
+            std::vector<gc::Local<Vec>> vecs;
+            for (size_t i = 0; i < n; i++) {
+                vecs.push_back(gc::Local<Vec>::make());
+            }
+            // grown an element at a time while collections run: in the inline slots, then across into the first
+            // buffer, and on into larger ones that retire the old
+            for (int k = 0; k < 20; k++) {
+                for (size_t i = 0; i < n; i++) {
+                    vecs[i]->push_back(gc::Local<Box>::make(static_cast<int>(i) * 100 + k));
+                    for (int j = 0; j < 16; j++) {
+                        gc::Local<Box>::make(-1);
+                    }
+                }
+                if (k == 2) {
+                    GC_ASSERT(vecs[0]->capacity() == 3, "three elements should still fit inline");
+                }
+            }
+            GC_ASSERT(heap.stats().n_collection_cycles > 1, "should have collected while growing");
+            for (size_t i = 0; i < n; i++) {
+                GC_ASSERT(vecs[i]->size() == 20 && vecs[i]->capacity() > 3, "vector should have spilled");
+                for (int k = 0; k < 20; k++) {
+                    GC_ASSERT(vecs[i]->at(k)->value == static_cast<int>(i) * 100 + k, "element lost across the spill");
+                }
+            }
+        }
+        gc::GcHeap::destroy();
+    }
 }
 int main() {
     // test_wb();
@@ -9,13 +9,15 @@ struct GcPolicy {
     using Owned = gc::Local<T>;
     template<class T>
     using Member = gc::Member<T>;
-    template<class T>
-    using Array = gc::GcVector<T>;
+    // the first `N` elements inline, see `gc::GcVector`
+    template<class T, size_t N = 0>
+    using Array = gc::GcVector<T, N>;
     template<class T>
     using Enable = gc::GarbageCollected<T>;
 
     template<class K, class V>
     using HashMap = gc::GcHashMap<K, V>;
+    using String = gc::GcString;
 
     gc::GcOption option{};
     void init() {
@@ -29,6 +31,9 @@ struct GcPolicy {
     static Owned<T> make(Args &&...args) {
         return gc::Local<T>::make(std::forward<Args>(args)...);
     }
+    static Owned<String> make_string(std::string_view s) {
+        return gc::GcString::make(s);
+    }
     std::string name() const {
         std::stringstream ss;
         ss << "GC " << gc::to_string(option.mode);
@@ -61,6 +66,16 @@ struct RcHashMap : public rc::RcFromThis<RcHashMap<K, V, CounterPolicy>, Counter
     using Base::Base;
 };
 template<class CounterPolicy>
+struct RcString : public rc::RcFromThis<RcString<CounterPolicy>, CounterPolicy>, std::pmr::string {
+    explicit RcString(std::string_view s) : std::pmr::string(s) {}
+};
+template<class CounterPolicy>
+struct std::hash<RcString<CounterPolicy>> {
+    size_t operator()(const RcString<CounterPolicy> &s) const {
+        return std::hash<std::pmr::string>{}(s);
+    }
+};
+template<class CounterPolicy>
 struct RcPolicy {
     template<class T>
     using Ptr = T *;
@@ -68,13 +83,14 @@ struct RcPolicy {
     using Owned = rc::RcPtr<T, CounterPolicy>;
     template<class T>
     using Member = rc::DummyMember<T, CounterPolicy>;
-    template<class T>
+    template<class T, size_t N = 0>
     using Array = RcVec<T, CounterPolicy>;
     template<class T>
     using Enable = rc::RcFromThis<T, CounterPolicy>;
 
     template<class K, class V>
     using HashMap = RcHashMap<K, V, CounterPolicy>;
+    using String = RcString<CounterPolicy>;
 
     std::pmr::memory_resource *old_resource{};
     void init() {
@@ -88,6 +104,9 @@ struct RcPolicy {
     static Owned<T> make(Args &&...args) {
         return Owned<T>(typename Owned<T>::init_t{}, std::forward<Args>(args)...);
     }
+    static Owned<String> make_string(std::string_view s) {
+        return make<String>(s);
+    }
     std::string name() const {
         if constexpr (std::is_same_v<CounterPolicy, rc::RefCounter>) {
             return "RC RefCounter";
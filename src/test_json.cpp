@@ -10,16 +10,18 @@
 template<class C>
 struct JsonValue;
 template<class C>
-using JsonDict = typename C::template HashMap<gc::Adaptor<std::string>,
+using JsonDict = typename C::template HashMap<typename C::String,
                                               JsonValue<C>>;
+// arrays in typical documents hold a handful of values, which then live in the array object itself
 template<class C>
-using JsonArray = typename C::template Array<JsonValue<C>>;
+using JsonArray = typename C::template Array<JsonValue<C>, 4>;
 template<class C>
 using JsonValueBase = std::variant<
-    std::monostate, bool, double, std::string, typename C::template Member<JsonDict<C>>, typename C::template Member<JsonArray<C>>>;
+    std::monostate, bool, double, typename C::template Member<typename C::String>, typename C::template Member<JsonDict<C>>, typename C::template Member<JsonArray<C>>>;
 template<class C>
 struct JsonValue : gc::GarbageCollected<JsonValueBase<C>>, JsonValueBase<C> {
     using Base = JsonValueBase<C>;
+    static constexpr bool gc_imageable = true;
     // using Base::Base;
     void trace(const gc::Tracer &tracer) const {
         std::visit([&](const auto &v) {
@@ -27,6 +29,8 @@ struct JsonValue : gc::GarbageCollected<JsonValueBase<C>>, JsonValueBase<C> {
                 tracer(v);
             } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, typename C::template Member<JsonArray<C>>>) {
                 tracer(v);
+            } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, typename C::template Member<typename C::String>>) {
+                tracer(v);
             }
         },
                    *this);
@@ -42,11 +46,14 @@ struct JsonValue : gc::GarbageCollected<JsonValueBase<C>>, JsonValueBase<C> {
         // printf("index = %d\n", Base::index());
         array = v;
     }
+    explicit JsonValue(const typename C::template Ptr<typename C::String> &v) : Base(std::monostate{}) {
+        auto &str = Base::template emplace<typename C::template Member<typename C::String>>(this);
+        str = v;
+    }
     explicit JsonValue(std::monostate = {}) : Base(std::monostate{}) {}
     explicit JsonValue(bool v) : Base(v) {}
     explicit JsonValue(int64_t v) : Base(v) {}
     explicit JsonValue(double v) : Base(v) {}
-    explicit JsonValue(const std::string &v) : Base(v) {}
     static JsonValue array() {
         return JsonValue(C::template make<JsonArray<C>>());
     }
@@ -59,7 +66,7 @@ struct JsonValue : gc::GarbageCollected<JsonValueBase<C>>, JsonValueBase<C> {
         return std::holds_alternative<std::monostate>(*this);
     }
     bool is_string() const {
-        return std::holds_alternative<std::string>(*this);
+        return std::holds_alternative<typename C::template Member<typename C::String>>(*this);
     }
     bool is_bool() const {
         return std::holds_alternative<bool>(*this);
@@ -68,19 +75,19 @@ struct JsonValue : gc::GarbageCollected<JsonValueBase<C>>, JsonValueBase<C> {
         return std::holds_alternative<double>(*this);
     }
     bool is_array() const {
-        return std::holds_alternative<C::template Member<JsonArray<C>>>(*this);
+        return std::holds_alternative<typename C::template Member<JsonArray<C>>>(*this);
     }
     bool is_dict() const {
-        return std::holds_alternative<C::template Member<JsonDict<C>>>(*this);
+        return std::holds_alternative<typename C::template Member<JsonDict<C>>>(*this);
     }
     auto &as_array() {
-        return std::get<C::template Member<JsonArray<C>>>(*this);
+        return std::get<typename C::template Member<JsonArray<C>>>(*this);
     }
     auto &as_dict() {
-        return std::get<C::template Member<JsonDict<C>>>(*this);
+        return std::get<typename C::template Member<JsonDict<C>>>(*this);
     }
     auto &as_string() {
-        return std::get<std::string>(*this);
+        return std::get<typename C::template Member<typename C::String>>(*this);
     }
     auto &as_bool() {
         return std::get<bool>(*this);
@@ -128,7 +135,8 @@ struct Parser {
             auto array = parse_array();
             return C::template make<JsonValue<C>>(array.get());
         } else if (c == '"') {
-            return C::template make<JsonValue<C>>(parse_string());
+            auto str = C::make_string(parse_string());
+            return C::template make<JsonValue<C>>(str.get());
         } else if (c == 't' || c == 'f') {
             return C::template make<JsonValue<C>>(parse_bool());
         } else if (c == 'n') {
@@ -276,7 +284,7 @@ struct Parser {
             }
             pos++;
             auto value = parse_value();
-            dict->insert(std::make_pair(C::template make<gc::Adaptor<std::string>>(std::move(key)), value));
+            dict->insert(std::make_pair(C::make_string(key), value));
             skip_ws();
             if (get() == ',') {
                 pos++;
@@ -311,8 +319,8 @@ struct Formatter {
                 write(v ? "true" : "false");
             } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, double>) {
                 ss << v;
-            } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, std::string>) {
-                ss << "\"" << v << "\"";
+            } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, typename C::template Member<typename C::String>>) {
+                ss << "\"" << *v << "\"";
             } else if constexpr (std::is_same_v<std::decay_t<decltype(v)>, typename C::template Member<JsonDict<C>>>) {
                 write_line("{");
                 indent++;
@@ -391,5 +399,33 @@ int main() {
     bench(GcPolicy{option});
     option.mode = gc::GcMode::CONCURRENT;
     bench(GcPolicy{option});
+
+    // the same DOM written to a heap image once, then mapped back instead of parsed
+    option = gc::GcOption{};
+    option.max_heap_size = 1024 * 1024 * 256;
+    option.mode = gc::GcMode::STOP_THE_WORLD;
+    GcPolicy policy{option};
+    policy.init();
+    {
+        std::ifstream ifs("large-file.json");
+        std::string json_s((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        auto json = parse_json(policy, json_s);
+        GC_ASSERT(gc::save_image(json.get(), "large-file.gcimage"), "Failed to write the image");
+        auto expected = Formatter<GcPolicy>::format(*json);
+        StatsTracker tracker;
+        for (int i = 0; i < 5; i++) {
+            auto t = std::chrono::high_resolution_clock::now();
+            auto image = gc::load_image<JsonValue<GcPolicy>>("large-file.gcimage");
+            auto elapsed = (std::chrono::high_resolution_clock::now() - t).count() * 1e-9;
+            tracker.update(elapsed);
+            GC_ASSERT(image.get() != nullptr, "Failed to load the image");
+            if (i == 0) {
+                GC_ASSERT(Formatter<GcPolicy>::format(*image) == expected, "The image differs from the parsed DOM");
+            }
+        }
+        tracker.print_latex_table((policy.name() + " image").c_str());
+    }
+    policy.finalize();
+    std::remove("large-file.gcimage");
     return 0;
 }
\ No newline at end of file
@@ -256,7 +256,8 @@ void render(C policy, int width, int height, bool parallel = false) {
 
 int main() {
     // the parallel version could run out of memory due to mutators allocates too fast
-    // the error during an OOM might not be straightforward due to std::abort() in multithreaded context
+    // an OOM throws std::bad_alloc on whichever render thread failed to allocate. nothing here catches it, so it
+    // escapes the thread and the process still terminates
     int w = 800, h = 800;
     render(RcPolicy<rc::RefCounter>{}, w, h);
     render(RcPolicy<rc::AtomicRefCounter>{}, w, h);